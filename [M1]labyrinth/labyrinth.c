@@ -1,19 +1,88 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime 等 POSIX 接口，-std=c11 下也能编译
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdatomic.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#endif
+
+// 可选的 USDT 静态探针：以 -DLABYRINTH_USDT 编译时生效（需要 systemtap 的 sys/sdt.h），
+// 可用 bpftrace/perf 挂载 usdt:labyrinth:*；未定义时展开为空，没有任何开销
+#ifdef LABYRINTH_USDT
+#include <sys/sdt.h>
+#define LAB_PROBE1(name, a) DTRACE_PROBE1(labyrinth, name, a)
+#define LAB_PROBE2(name, a, b) DTRACE_PROBE2(labyrinth, name, a, b)
+#define LAB_PROBE3(name, a, b, c) DTRACE_PROBE3(labyrinth, name, a, b, c)
+#define LAB_PROBE4(name, a, b, c, d) DTRACE_PROBE4(labyrinth, name, a, b, c, d)
+#else
+#define LAB_PROBE1(name, a) ((void)0)
+#define LAB_PROBE2(name, a, b) ((void)0)
+#define LAB_PROBE3(name, a, b, c) ((void)0)
+#define LAB_PROBE4(name, a, b, c, d) ((void)0)
+#endif
 
 #define MAX_ROWS 110
 #define MAX_COLS 110
 #define MAX_MAP_DIM 100
+#define MAX_PLAYERS 10
+#define PLAN_WINDOW 32      // 协同规划的时间窗口长度
+#define PLAN_MAX_TICKS 1024 // 协同规划的总步数上限
+#define MAX_ROUTE_BLOCKS 16
+#define ROUTE_MAX_STEPS (4 * MAX_MAP_DIM * MAX_MAP_DIM) // 单玩家寻路的步数上限
+#define MAX_SET_EDITS 64     // 命令行 --set 的最大个数
+
+// 地形代价类别：地形格在 cells 中仍记为 '.'，类别单独存放在 terrain 层
+typedef enum
+{
+    TERRAIN_PLAIN, // '.'
+    TERRAIN_MUD,   // ','
+    TERRAIN_WATER, // '~'
+    TERRAIN_CLASSES
+} Terrain;
+
+static const char TERRAIN_CHARS[TERRAIN_CLASSES] = {'.', ',', '~'};
+static const int TERRAIN_COST[TERRAIN_CLASSES] = {1, 3, 5};
+#define MAX_TERRAIN_COST 5
 
 typedef struct
 {
     int rows;
     int cols;
     char cells[MAX_ROWS][MAX_COLS];
+    unsigned char terrain[MAX_ROWS][MAX_COLS];
+    // 邻居掩码，第 d 位对应方向 d（DIR_DX/DIR_DY 的序号），地图外的邻居为 0：
+    // 低 4 位为 is_empty 的邻居，高 4 位为 '.' 的邻居。加载后由 map_build_neighbours
+    // 建立，之后由 set_cell 维护
+    unsigned char neighbours[MAX_ROWS][MAX_COLS];
 } Map;
+#define NEIGHBOUR_EMPTY(mask) ((mask) & 0x0F)
+#define NEIGHBOUR_FREE(mask) ((mask) >> 4)
+
+// 增量地图解析器：数据按任意大小的块送入，跨块的半行暂存在 line 中
+#define MAP_LINE_MAX 1024
+typedef struct
+{
+    Map *map;
+    char line[MAP_LINE_MAX];
+    size_t line_len;
+    bool saw_cr; // 出现过 '\r'（CRLF 文件），行尾需要额外处理
+} MapParser;
 
 typedef enum
 {
@@ -22,52 +91,539 @@ typedef enum
     ERR_MAP_NOT_FOUND,
     ERR_INVALID_MAP,
     ERR_MULTIPLE_EMPTY_AREAS,
-    ERR_MOVE_FAILED
+    ERR_MOVE_FAILED,
+    ERR_NO_PATH,
+    ERR_EDIT_FAILED,
+    ERR_MEMORY // 内存分配失败
 } ErrorCode;
 
+// 按块接收解码后的地图文本
+typedef ErrorCode (*TextSink)(void *ctx, const char *data, size_t len);
+
+// 带预读缓冲的字节输入，用于识别压缩格式并逐字节解码
+typedef struct
+{
+    FILE *fp;
+    size_t pos;
+    size_t len;
+    unsigned char buf[1 << 16];
+} ByteReader;
+
+// 可替换的地图存储后端：与 Map 一样分为 cells（'#'、'.'、玩家数字）与 terrain 两层，
+// 坐标为 1 起始。除 grid 外的后端没有 MAX_MAP_DIM 限制，用于超大地图
+typedef struct MapBackend MapBackend;
+typedef struct
+{
+    const char *name;
+    MapBackend *(*create)(void);
+    ErrorCode (*append_row)(MapBackend *b, const char *row); // row 为已校验的 cols 个显示字符
+    void (*finish_load)(MapBackend *b);                      // 可为 NULL：所有行加载完毕后调用
+    char (*cell)(const MapBackend *b, long x, long y);
+    int (*terrain)(const MapBackend *b, long x, long y);
+    ErrorCode (*set_cell)(MapBackend *b, long x, long y, char c); // 失败时不修改地图
+    bool (*find)(const MapBackend *b, char c, long *x, long *y); // 行优先第一个 cell 为 c 的格子
+    void (*row_text)(const MapBackend *b, long x, char *out);     // 可为 NULL：第 x 行的 cols 个显示字符写入 out
+    ErrorCode (*validate)(const MapBackend *b);                   // 为 NULL 时使用通用的逐行扫描
+    void (*destroy)(MapBackend *b);
+} MapBackendOps;
+
+struct MapBackend
+{
+    const MapBackendOps *ops;
+    long rows;
+    long cols;
+};
+
+// 默认后端：直接包装 Map，其余代码路径（观察者、插桩、探针）保持不变
+typedef struct
+{
+    MapBackend base;
+    Map *map;
+    bool owned; // map 由后端分配，destroy 时释放
+} GridBackend;
+
+typedef enum
+{
+    MODE_PLAY, // 默认模式：可选移动后打印地图
+    MODE_PLAN, // 多玩家协同规划
+    MODE_ROUTE,   // 单个玩家增量寻路并沿路径移动
+    MODE_DIJKSTRA, // 按地形代价寻找最小代价路径并沿路径移动
+    MODE_REACH,      // 查询玩家 k 步内可到达的格子
+    MODE_WOULD_SPLIT, // 查询把某格改为墙是否会分割空区域
+    MODE_COMPONENTS,  // 报告所有空区域而不是在第二个区域处失败
+    MODE_REPAIR,      // 拆除最少的墙把多个空区域连成一片
+    MODE_DIAMETER,    // 计算空区域直径与各玩家的离心率
+    MODE_GENERATE,    // 生成随机迷宫，不读取地图
+    MODE_BENCH,       // 分阶段计时的基准测试，不读取地图
+    MODE_SCRIPT,      // 批处理/常驻模式：逐行执行命令文件（或 stdin）中的命令
+    MODE_STREAM_VALIDATE // 逐行流式验证，不把整张地图读入内存，也不受尺寸上限限制
+} RunMode;
+
+typedef struct
+{
+    int player;
+    int x;
+    int y;
+} Goal;
+
+// 寻路途中的动态障碍：玩家走完 step 步后，在 (x, y) 放置墙
+typedef struct
+{
+    int step;
+    int x;
+    int y;
+} RouteBlock;
+
+typedef struct
+{
+    int x;
+    int y;
+    char c;
+} Edit;
+
+typedef enum
+{
+    STATS_NONE,
+    STATS_TEXT, // --stats：每行 "键 值"
+    STATS_JSON  // --stats=json：单个 JSON 对象
+} StatsFormat;
+
+// 迷宫生成参数
+typedef struct
+{
+    long rows;
+    long cols;
+    uint64_t seed;
+    int density; // 0-100：额外打通墙壁（形成回路、更开阔）的概率
+    int players; // 放置的玩家个数（玩家 1..players）
+} GenerateOptions;
+
+typedef struct
+{
+    char *map_filename;
+    char *player_str;
+    char *move_direction;
+    RunMode mode;
+    int goal_count;
+    Goal goals[MAX_PLAYERS];
+    int block_count;
+    RouteBlock blocks[MAX_ROUTE_BLOCKS];
+    int target_x;
+    int target_y;
+    int reach_steps;
+    int set_count;
+    Edit sets[MAX_SET_EDITS];
+    char *edits_filename;
+    bool dump_labels;
+    StatsFormat stats_format;
+    GenerateOptions generate;
+    int bench_runs;
+    char *script_filename; // "-" 表示从 stdin 读取
+    const MapBackendOps *backend; // --backend 选择的存储后端，NULL 为默认的 Map
+} Options;
+
+// 协同规划结果：moves[p][t] 为玩家 p 在第 t 步的动作（方向下标或 DIR_WAIT）
+typedef struct
+{
+    int ticks;
+    bool active[MAX_PLAYERS];
+    int final_x[MAX_PLAYERS];
+    int final_y[MAX_PLAYERS];
+    signed char moves[MAX_PLAYERS][PLAN_MAX_TICKS];
+} Plan;
+
+// 单玩家寻路结果：moves[t] 为第 t 步实际走的方向
+typedef struct
+{
+    int player;
+    int steps;
+    signed char moves[ROUTE_MAX_STEPS];
+} Route;
+
+#define DIR_WAIT 4
+static const int DIR_DX[4] = {-1, 1, 0, 0};
+static const int DIR_DY[4] = {0, 0, -1, 1};
+static const char *const DIR_NAMES[5] = {"up", "down", "left", "right", "wait"};
+
+// 按位压缩的地图：每行 BITSET_WORDS 个 64 位字，第 y 位对应第 y 列
+#define BITSET_WORDS ((MAX_COLS + 63) / 64)
+typedef struct
+{
+    uint64_t bits[MAX_ROWS][BITSET_WORDS];
+} BitGrid;
+
+// 割点索引：cut[x][y] 表示把该空格改为墙会把空区域分成多块
+typedef struct
+{
+    const Map *map;
+    bool valid; // 空地集合变化后置为 false，下次查询时重建
+    bool cut[MAX_ROWS][MAX_COLS];
+} CutIndex;
+
+// 动态连通性：并查集只在格子打开时增长；格子关闭时先做局部检查，
+// 无法确认仍连通时才整体重建。components 为当前空区域个数
+#define UF_POOL_SIZE (2 * MAX_ROWS * MAX_COLS)
+typedef struct
+{
+    const Map *map;
+    int components;
+    int node[MAX_ROWS * MAX_COLS]; // 每个格子当前对应的并查集节点
+    int node_count;
+    int parent[UF_POOL_SIZE];
+} Connectivity;
+
+// 空区域信息：编号从 1 开始，包含大小、外接矩形与一个代表格
+typedef struct
+{
+    int size;
+    int min_x, max_x;
+    int min_y, max_y;
+    int rep_x, rep_y;
+} ComponentInfo;
+
+#define MAX_COMPONENTS (MAX_ROWS * MAX_COLS / 2 + 1)
+
+// 空区域统计：在 validate_map 遍历唯一空区域时顺带计算
+typedef struct
+{
+    int cells;
+    int perimeter; // 与墙或地图边界相邻的边数
+    int dead_ends; // 只有一个空邻居的格子
+    int junctions; // 有三个及以上空邻居的格子
+    int min_x, max_x;
+    int min_y, max_y;
+} AreaStats;
+
+// 单次运行的插桩数据：各阶段耗时、搜索规模与内存，退出时输出到 stderr
+typedef struct
+{
+    StatsFormat format;
+    uint64_t parse_ns;
+    uint64_t validate_ns;
+    uint64_t move_ns;
+    uint64_t print_ns;
+    long moves;
+    long cells_visited; // deep_search 访问的格子数
+    int depth;          // deep_search 当前递归深度
+    int max_depth;
+    bool has_area;
+    AreaStats area;
+} RunStats;
+
+static RunStats run_stats;
+
+// 延迟直方图：HDR 风格的对数分桶，每个 2 的幂区间再细分为 2^LATENCY_SUB_BITS 个子桶，
+// 相对误差不超过 1/16。每个线程写自己的直方图（无锁），报告时合并所有已登记的直方图
+#define LATENCY_SUB_BITS 4
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+#define MAX_LATENCY_THREADS 64
+
+typedef enum
+{
+    LATENCY_MOVE,
+    LATENCY_QUERY,
+    LATENCY_PRINT,
+    LATENCY_KINDS
+} LatencyKind;
+
+typedef struct
+{
+    _Atomic uint64_t counts[LATENCY_KINDS][LATENCY_BUCKETS];
+    _Atomic uint64_t max_ns[LATENCY_KINDS];
+} LatencyHistogram;
+
+// 格子变化观察者：每次通过 set_cell 修改地图后被调用，old_cell 为修改前的字符
+typedef void (*CellObserver)(void *ctx, const Map *map, int x, int y, char old_cell);
+#define MAX_CELL_OBSERVERS 8
+
+// D* Lite 增量寻路状态：在查询之间保留 g/rhs 与优先队列，格子变化时只修复受影响部分
+typedef struct
+{
+    const Map *map;
+    int player;
+    int start_x, start_y;
+    int last_x, last_y;
+    int goal_x, goal_y;
+    int km;
+    int g[MAX_ROWS][MAX_COLS];
+    int rhs[MAX_ROWS][MAX_COLS];
+    int key1[MAX_ROWS][MAX_COLS];
+    int key2[MAX_ROWS][MAX_COLS];
+    int heap_pos[MAX_ROWS][MAX_COLS]; // -1 表示不在队列中
+    int heap[MAX_ROWS * MAX_COLS];
+    int heap_size;
+} DStarLite;
+
 // 函数声明
 void print_version(void);
-ErrorCode parse_arguments(int argc, char *argv[], char **map_filename, char **player_str, char **move_direction);
+ErrorCode parse_arguments(int argc, char *argv[], Options *opts);
+ErrorCode parse_goal(const char *str, Goal *goal);
 ErrorCode load_map(const char *filename, Map *map);
-ErrorCode validate_map(const Map *map);
-void deep_search(int x, int y, int visited[MAX_ROWS][MAX_COLS], const Map *map);
+FILE *open_map_input(const char *filename);
+void close_map_input(FILE *fp);
+ErrorCode load_map_stream(FILE *fp, Map *map);
+ErrorCode read_map_input(FILE *fp, TextSink sink, void *ctx);
+void map_parser_init(MapParser *parser, Map *map);
+ErrorCode map_parser_feed(MapParser *parser, const char *data, size_t len);
+ErrorCode map_parser_finish(MapParser *parser);
+static ErrorCode map_parser_sink(void *ctx, const char *data, size_t len);
+ErrorCode validate_map(const Map *map, AreaStats *stats);
+void deep_search(int x, int y, int visited[MAX_ROWS][MAX_COLS], const Map *map, AreaStats *stats);
+void print_area_stats(FILE *out, const AreaStats *stats);
+void print_run_stats(void);
+long peak_rss_kb(void);
 bool is_empty(int x, int y, const Map *map);
 bool is_player(int x, int y, const Map *map, int player);
 void print_map(const Map *map);
+void fprint_map(FILE *out, const Map *map);
 void trim_newline(char *str);
 ErrorCode move_player(Map *map, int player, const char *direction);
+static ErrorCode move_player_once(Map *map, int player, const char *direction, int *x, int *y);
+int parse_direction(const char *direction);
+void bfs_distances(const Map *map, int sx, int sy, int dist[MAX_ROWS][MAX_COLS]);
+ErrorCode plan_cooperative(const Map *map, const Goal *goals, int goal_count, Plan *plan);
+void print_plan(const Plan *plan);
+void apply_plan(Map *map, const Plan *plan);
+void set_cell(Map *map, int x, int y, char c);
+void map_build_neighbours(Map *map);
+void add_cell_observer(CellObserver observer, void *ctx);
+void remove_cell_observer(CellObserver observer, void *ctx);
+ErrorCode parse_cell(const char *str, int *x, int *y);
+void dstar_init(DStarLite *ds, const Map *map, int player, int sx, int sy, int gx, int gy);
+void dstar_set_start(DStarLite *ds, int sx, int sy);
+void dstar_cell_changed(void *ctx, const Map *map, int x, int y, char old_cell);
+ErrorCode dstar_next_step(DStarLite *ds, int *dir);
+ErrorCode parse_block(const char *str, RouteBlock *block);
+ErrorCode route_player(Map *map, int player, int gx, int gy, const RouteBlock *blocks, int block_count, Route *route);
+void print_route(const Route *route);
+int terrain_class(char c);
+ErrorCode dijkstra_route(const Map *map, int player, int gx, int gy, int *cost, int *dirs, int *length);
+void build_free_bits(const Map *map, BitGrid *free_bits);
+ErrorCode reachable_within(const Map *map, int player, int k, BitGrid *reach, int *count);
+void cut_index_build(CutIndex *index, const Map *map);
+void cut_index_cell_changed(void *ctx, const Map *map, int x, int y, char old_cell);
+bool would_split(CutIndex *index, int x, int y);
+ErrorCode parse_edit(const char *str, Edit *edit);
+ErrorCode edit_cell(Map *map, const Edit *edit);
+ErrorCode apply_edit_file(Map *map, const char *filename);
+void connectivity_build(Connectivity *conn, const Map *map);
+void connectivity_cell_changed(void *ctx, const Map *map, int x, int y, char old_cell);
+int label_components(const Map *map, int labels[MAX_ROWS][MAX_COLS], ComponentInfo *infos);
+void print_components(const Map *map, bool dump_labels);
+ErrorCode repair_map(Map *map, int *removed);
+int area_diameter(const Map *map, int *bfs_runs);
+int eccentricity(const Map *map, int x, int y);
+ErrorCode parse_long(const char *str, long min, long max, long *value);
+uint64_t rng_next(uint64_t *state);
+ErrorCode generate_maze(FILE *out, const GenerateOptions *gen);
+ErrorCode stream_validate(FILE *fp, long *rows, long *cols);
+uint64_t now_ns(void);
+ErrorCode run_benchmarks(FILE *out, int runs);
+void latency_record(LatencyKind kind, uint64_t ns);
+void print_latency_report(void);
+ErrorCode run_script(MapBackend *b, const char *filename);
+const MapBackendOps *find_backend(const char *name);
+ErrorCode backend_load(MapBackend *b, FILE *fp);
+ErrorCode backend_validate(const MapBackend *b);
+char backend_display(const MapBackend *b, long x, long y);
+ErrorCode backend_move_player(MapBackend *b, int player, const char *direction);
+void backend_print(const MapBackend *b);
+void grid_backend_wrap(GridBackend *g, Map *map);
+Map *grid_backend_map(const MapBackend *b);
 
 int main(int argc, char *argv[])
 {
-    char *map_filename = NULL;
-    char *player_str = NULL;
-    char *move_direction = NULL;
-
-    ErrorCode err = parse_arguments(argc, argv, &map_filename, &player_str, &move_direction);
+    Options opts;
+    ErrorCode err = parse_arguments(argc, argv, &opts);
     if (err != ERR_NONE)
     {
-        fprintf(stderr, "Usage: %s -m <map_file> -p <player_id> [--move direction]\n", argv[0]);
+        fprintf(stderr, "Usage: %s -m <map_file|-> -p <player_id> [--move direction] [--set R,C=X ...] [--edits file] [--stats[=json]] [--backend NAME]\n", argv[0]);
+        fprintf(stderr, "       %s -m <map_file> --goal P=R,C [--goal P=R,C ...]\n", argv[0]);
+        fprintf(stderr, "       %s -m <map_file> -p <player_id> --route R,C [--block K:R,C ...]\n", argv[0]);
+        fprintf(stderr, "       %s -m <map_file> -p <player_id> --dijkstra R,C\n", argv[0]);
+        fprintf(stderr, "       %s -m <map_file> -p <player_id> --reach K\n", argv[0]);
+        fprintf(stderr, "       %s -m <map_file> --would-split R,C\n", argv[0]);
+        fprintf(stderr, "       %s -m <map_file> --components[=labels]\n", argv[0]);
+        fprintf(stderr, "       %s -m <map_file> --repair\n", argv[0]);
+        fprintf(stderr, "       %s -m <map_file> --diameter\n", argv[0]);
+        fprintf(stderr, "       %s --generate ROWS COLS [--seed S] [--density 0-100] [--players N]\n", argv[0]);
+        fprintf(stderr, "       %s --bench[=RUNS]\n", argv[0]);
+        fprintf(stderr, "       %s -m <map_file> --script <file|->\n", argv[0]);
+        fprintf(stderr, "       %s -m <map_file> --stream-validate\n", argv[0]);
         return 1;
     }
 
+    // 基准测试：生成各类地图并分阶段计时，CSV 输出到 stdout
+    if (opts.mode == MODE_BENCH)
+    {
+        if (run_benchmarks(stdout, opts.bench_runs) != ERR_NONE)
+        {
+            fprintf(stderr, "Benchmark failed.\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    // 插桩报告在退出时输出，因此出错提前返回时也能看到已完成阶段的数据
+    run_stats.format = opts.stats_format;
+    if (opts.stats_format != STATS_NONE)
+    {
+        atexit(print_run_stats);
+    }
+
+    // 迷宫生成：逐行流式输出到 stdout，不需要地图文件
+    if (opts.mode == MODE_GENERATE)
+    {
+        if (generate_maze(stdout, &opts.generate) != ERR_NONE)
+        {
+            fprintf(stderr, "Maze generation failed.\n");
+            return 1;
+        }
+        return 0;
+    }
+
     // 校验玩家参数是否为单个数字
-    if (player_str[0] < '0' || player_str[0] > '9' || player_str[1] != '\0')
+    int player = -1;
+    if (opts.player_str != NULL)
     {
-        fprintf(stderr, "Player must be a single digit between 0 and 9.\n");
-        return 1;
+        if (opts.player_str[0] < '0' || opts.player_str[0] > '9' || opts.player_str[1] != '\0')
+        {
+            fprintf(stderr, "Player must be a single digit between 0 and 9.\n");
+            return 1;
+        }
+        player = opts.player_str[0] - '0';
+    }
+
+    // 流式验证：边读边判定连通性，只保留两行标签，不构造 Map
+    if (opts.mode == MODE_STREAM_VALIDATE)
+    {
+        FILE *fp = open_map_input(opts.map_filename);
+        if (!fp)
+        {
+            fprintf(stderr, "Error loading map file: %d\n", ERR_MAP_NOT_FOUND);
+            return 1;
+        }
+        long rows, cols;
+        uint64_t validate_start = now_ns();
+        err = stream_validate(fp, &rows, &cols);
+        run_stats.validate_ns = now_ns() - validate_start;
+        close_map_input(fp);
+        if (err == ERR_MULTIPLE_EMPTY_AREAS)
+        {
+            fprintf(stderr, "Map contains more than one empty area.\n");
+            return 1;
+        }
+        else if (err != ERR_NONE)
+        {
+            fprintf(stderr, "Error loading map file: %d\n", err);
+            return 1;
+        }
+        printf("valid %ld %ld\n", rows, cols);
+        return 0;
+    }
+
+    // 替换存储后端：加载、验证后执行移动并打印，或执行批处理命令
+    if (opts.backend != NULL)
+    {
+        MapBackend *backend = opts.backend->create();
+        if (backend == NULL)
+        {
+            fprintf(stderr, "Error loading map file: %d\n", ERR_MEMORY);
+            return 1;
+        }
+        FILE *fp = open_map_input(opts.map_filename);
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Error loading map file: %d\n", ERR_MAP_NOT_FOUND);
+            backend->ops->destroy(backend);
+            return 1;
+        }
+        uint64_t parse_start = now_ns();
+        err = backend_load(backend, fp);
+        run_stats.parse_ns = now_ns() - parse_start;
+        close_map_input(fp);
+        if (err != ERR_NONE)
+        {
+            fprintf(stderr, "Error loading map file: %d\n", err);
+        }
+        else
+        {
+            uint64_t validate_start = now_ns();
+            err = backend_validate(backend);
+            run_stats.validate_ns = now_ns() - validate_start;
+            if (err == ERR_MULTIPLE_EMPTY_AREAS)
+            {
+                fprintf(stderr, "Map contains more than one empty area.\n");
+            }
+            else if (err != ERR_NONE)
+            {
+                fprintf(stderr, "Map validation failed: %d\n", err);
+            }
+        }
+        if (err == ERR_NONE && opts.mode == MODE_SCRIPT)
+        {
+            atexit(print_latency_report);
+            err = run_script(backend, opts.script_filename);
+            if (err != ERR_NONE)
+            {
+                fprintf(stderr, "Cannot read script.\n");
+            }
+        }
+        else if (err == ERR_NONE)
+        {
+            if (opts.move_direction != NULL)
+            {
+                err = backend_move_player(backend, player, opts.move_direction);
+            }
+            if (err != ERR_NONE)
+            {
+                fprintf(stderr, "Move failed.\n");
+            }
+            else
+            {
+                backend_print(backend);
+            }
+        }
+        backend->ops->destroy(backend);
+        return err == ERR_NONE ? 0 : 1;
     }
-    int player = player_str[0] - '0';
 
     Map map;
-    err = load_map(map_filename, &map);
+    uint64_t parse_start = now_ns();
+    err = load_map(opts.map_filename, &map);
+    run_stats.parse_ns = now_ns() - parse_start;
     if (err != ERR_NONE)
     {
         fprintf(stderr, "Error loading map file: %d\n", err);
         return 1;
     }
 
+    // 空区域分析：报告所有区域，因此在验证之前执行
+    if (opts.mode == MODE_COMPONENTS)
+    {
+        print_components(&map, opts.dump_labels);
+        return 0;
+    }
+
+    // 自动修复：拆墙连通所有空区域后输出修复后的地图
+    if (opts.mode == MODE_REPAIR)
+    {
+        int removed;
+        err = repair_map(&map, &removed);
+        if (err != ERR_NONE)
+        {
+            fprintf(stderr, "Map cannot be repaired.\n");
+            return 1;
+        }
+        fprintf(stderr, "Removed %d walls.\n", removed);
+        print_map(&map);
+        return 0;
+    }
+
     // 地图验证（包括空区域检查）
-    err = validate_map(&map);
+    uint64_t validate_start = now_ns();
+    err = validate_map(&map, opts.stats_format != STATS_NONE ? &run_stats.area : NULL);
+    run_stats.validate_ns = now_ns() - validate_start;
     if (err == ERR_MULTIPLE_EMPTY_AREAS)
     {
         fprintf(stderr, "Map contains more than one empty area.\n");
@@ -78,11 +634,193 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Map validation failed: %d\n", err);
         return 1;
     }
+    run_stats.has_area = opts.stats_format != STATS_NONE;
+
+    // 割点索引在验证后建立并作为观察者挂在地图上：之后的 --set/--edits 若改变了
+    // 空地集合，索引失效并在查询时重建
+    static CutIndex cuts;
+    if (opts.mode == MODE_WOULD_SPLIT)
+    {
+        cut_index_build(&cuts, &map);
+        add_cell_observer(cut_index_cell_changed, &cuts);
+    }
+
+    // 编辑地图：动态连通性结构跟踪每次修改，只做局部工作
+    if (opts.set_count > 0 || opts.edits_filename != NULL)
+    {
+        static Connectivity conn;
+        connectivity_build(&conn, &map);
+        add_cell_observer(connectivity_cell_changed, &conn);
+        for (int k = 0; k < opts.set_count && err == ERR_NONE; k++)
+        {
+            err = edit_cell(&map, &opts.sets[k]);
+        }
+        if (err == ERR_NONE && opts.edits_filename != NULL)
+        {
+            err = apply_edit_file(&map, opts.edits_filename);
+        }
+        remove_cell_observer(connectivity_cell_changed, &conn);
+        if (err != ERR_NONE)
+        {
+            fprintf(stderr, "Edit failed.\n");
+            return 1;
+        }
+        if (conn.components > 1)
+        {
+            fprintf(stderr, "Map contains more than one empty area.\n");
+            return 1;
+        }
+    }
+
+    // 批处理/常驻模式：每条命令的延迟进入直方图，退出或收到 SIGUSR1 时输出分位数
+    if (opts.mode == MODE_SCRIPT)
+    {
+        static GridBackend grid;
+        grid_backend_wrap(&grid, &map);
+        atexit(print_latency_report);
+        err = run_script(&grid.base, opts.script_filename);
+        if (err != ERR_NONE)
+        {
+            fprintf(stderr, "Cannot read script.\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    // 直径分析：iFUB 只需少量 BFS；再对每名玩家做一次 BFS 求离心率
+    if (opts.mode == MODE_DIAMETER)
+    {
+        int bfs_runs;
+        printf("diameter %d\n", area_diameter(&map, &bfs_runs));
+        for (int i = 1; i <= map.rows; i++)
+        {
+            for (int j = 1; j <= map.cols; j++)
+            {
+                if (is_player(i, j, &map, -1))
+                {
+                    printf("player %c eccentricity %d\n", map.cells[i][j], eccentricity(&map, i, j));
+                }
+            }
+        }
+        fprintf(stderr, "Diameter used %d BFS runs.\n", bfs_runs);
+        return 0;
+    }
+
+    // 协同规划：为所有玩家生成互不碰撞的多步移动序列
+    if (opts.mode == MODE_PLAN)
+    {
+        static Plan plan;
+        err = plan_cooperative(&map, opts.goals, opts.goal_count, &plan);
+        if (err == ERR_INVALID_ARGS)
+        {
+            fprintf(stderr, "Invalid goal.\n");
+            return 1;
+        }
+        else if (err != ERR_NONE)
+        {
+            fprintf(stderr, "Planning failed.\n");
+            return 1;
+        }
+        print_plan(&plan);
+        apply_plan(&map, &plan);
+        print_map(&map);
+        return 0;
+    }
+
+    // 增量寻路：沿 D* Lite 给出的路径逐步移动玩家
+    if (opts.mode == MODE_ROUTE)
+    {
+        static Route route;
+        err = route_player(&map, player, opts.target_x, opts.target_y, opts.blocks, opts.block_count, &route);
+        if (err == ERR_INVALID_ARGS)
+        {
+            fprintf(stderr, "Invalid goal or block.\n");
+            return 1;
+        }
+        else if (err == ERR_MOVE_FAILED)
+        {
+            fprintf(stderr, "Block hit a player.\n");
+            return 1;
+        }
+        else if (err != ERR_NONE)
+        {
+            fprintf(stderr, "No path.\n");
+            return 1;
+        }
+        print_route(&route);
+        print_map(&map);
+        return 0;
+    }
+
+    // 带权寻路：输出最小代价与路径，然后沿路径移动玩家
+    if (opts.mode == MODE_DIJKSTRA)
+    {
+        static int dirs[MAX_ROWS * MAX_COLS];
+        int cost, length;
+        err = dijkstra_route(&map, player, opts.target_x, opts.target_y, &cost, dirs, &length);
+        if (err == ERR_INVALID_ARGS)
+        {
+            fprintf(stderr, "Invalid goal.\n");
+            return 1;
+        }
+        else if (err != ERR_NONE)
+        {
+            fprintf(stderr, "No path.\n");
+            return 1;
+        }
+        printf("cost %d:", cost);
+        for (int k = 0; k < length; k++)
+        {
+            printf(" %s", DIR_NAMES[dirs[k]]);
+            move_player(&map, player, DIR_NAMES[dirs[k]]);
+        }
+        printf("\n");
+        print_map(&map);
+        return 0;
+    }
+
+    // k 步可达查询：输出可达格数，并在地图上用 '+' 标出可达的空地
+    if (opts.mode == MODE_REACH)
+    {
+        static BitGrid reach;
+        int count;
+        err = reachable_within(&map, player, opts.reach_steps, &reach, &count);
+        if (err != ERR_NONE)
+        {
+            fprintf(stderr, "Player not found.\n");
+            return 1;
+        }
+        printf("reachable %d\n", count);
+        for (int i = 1; i <= map.rows; i++)
+        {
+            for (int j = 1; j <= map.cols; j++)
+            {
+                if (map.cells[i][j] == '.' && (reach.bits[i][j / 64] >> (j % 64) & 1))
+                {
+                    map.cells[i][j] = '+';
+                }
+            }
+        }
+        print_map(&map);
+        return 0;
+    }
+
+    // 割点查询：O(1) 回答该格改为墙是否会分割空区域（索引失效时先重建）
+    if (opts.mode == MODE_WOULD_SPLIT)
+    {
+        if (opts.target_x < 1 || opts.target_x > map.rows || opts.target_y < 1 || opts.target_y > map.cols)
+        {
+            fprintf(stderr, "Invalid cell.\n");
+            return 1;
+        }
+        printf("%s\n", would_split(&cuts, opts.target_x, opts.target_y) ? "yes" : "no");
+        return 0;
+    }
 
     // 如果指定了移动命令，则执行移动操作
-    if (move_direction != NULL)
+    if (opts.move_direction != NULL)
     {
-        err = move_player(&map, player, move_direction);
+        err = move_player(&map, player, opts.move_direction);
         if (err != ERR_NONE)
         {
             fprintf(stderr, "Move failed.\n");
@@ -99,17 +837,39 @@ void print_version(void)
     printf("Labyrinth Game version 1.0\n");
 }
 
-ErrorCode parse_arguments(int argc, char *argv[], char **map_filename, char **player_str, char **move_direction)
+ErrorCode parse_arguments(int argc, char *argv[], Options *opts)
 {
     int opt;
     int has_map = 0, has_player = 0;
-    *move_direction = NULL;
+    memset(opts, 0, sizeof(*opts));
+    opts->mode = MODE_PLAY;
+    opts->generate.seed = 1;
     int option_index = 0;
     static struct option long_options[] = {
         {"version", no_argument, 0, 'v'},
         {"map", required_argument, 0, 'm'},
         {"player", required_argument, 0, 'p'},
         {"move", required_argument, 0, 0}, // 仅支持长选项
+        {"goal", required_argument, 0, 0}, // 可重复：--goal P=R,C
+        {"route", required_argument, 0, 0},
+        {"block", required_argument, 0, 0}, // 可重复：--block K:R,C
+        {"dijkstra", required_argument, 0, 0},
+        {"reach", required_argument, 0, 0},
+        {"would-split", required_argument, 0, 0},
+        {"set", required_argument, 0, 0},   // 可重复：--set R,C=X
+        {"edits", required_argument, 0, 0}, // 批量编辑文件，每行一个 R,C=X
+        {"components", optional_argument, 0, 0},
+        {"repair", no_argument, 0, 0},
+        {"stats", optional_argument, 0, 0}, // --stats 或 --stats=json
+        {"diameter", no_argument, 0, 0},
+        {"generate", required_argument, 0, 0}, // --generate ROWS COLS
+        {"seed", required_argument, 0, 0},
+        {"density", required_argument, 0, 0},
+        {"players", required_argument, 0, 0},
+        {"bench", optional_argument, 0, 0},
+        {"script", required_argument, 0, 0}, // 命令文件，"-" 为 stdin
+        {"stream-validate", no_argument, 0, 0},
+        {"backend", required_argument, 0, 0}, // 地图存储后端：grid（默认）、runs、tiles、packed
         {0, 0, 0, 0}};
 
     while ((opt = getopt_long(argc, argv, "vm:p:", long_options, &option_index)) != -1)
@@ -121,242 +881,5854 @@ ErrorCode parse_arguments(int argc, char *argv[], char **map_filename, char **pl
             exit(0);
         case 'm':
             has_map = 1;
-            *map_filename = optarg;
+            opts->map_filename = optarg;
             break;
         case 'p':
             has_player = 1;
-            *player_str = optarg;
+            opts->player_str = optarg;
             break;
         case 0: // 处理没有短选项的长选项
             if (strcmp(long_options[option_index].name, "move") == 0)
             {
-                *move_direction = optarg;
+                opts->move_direction = optarg;
             }
-            break;
-        case '?':
-        default:
-            return ERR_INVALID_ARGS;
-        }
-    }
-
-    if (!has_map || !has_player)
-    {
-        return ERR_INVALID_ARGS;
-    }
-    return ERR_NONE;
-}
-
-ErrorCode load_map(const char *filename, Map *map)
-{
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-    {
+            else if (strcmp(long_options[option_index].name, "goal") == 0)
+            {
+                if (opts->goal_count >= MAX_PLAYERS ||
+                    parse_goal(optarg, &opts->goals[opts->goal_count]) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->goal_count++;
+                opts->mode = MODE_PLAN;
+            }
+            else if (strcmp(long_options[option_index].name, "route") == 0)
+            {
+                if (parse_cell(optarg, &opts->target_x, &opts->target_y) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->mode = MODE_ROUTE;
+            }
+            else if (strcmp(long_options[option_index].name, "block") == 0)
+            {
+                if (opts->block_count >= MAX_ROUTE_BLOCKS ||
+                    parse_block(optarg, &opts->blocks[opts->block_count]) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->block_count++;
+            }
+            else if (strcmp(long_options[option_index].name, "dijkstra") == 0)
+            {
+                if (parse_cell(optarg, &opts->target_x, &opts->target_y) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->mode = MODE_DIJKSTRA;
+            }
+            else if (strcmp(long_options[option_index].name, "reach") == 0)
+            {
+                char extra;
+                if (sscanf(optarg, "%d%c", &opts->reach_steps, &extra) != 1 || opts->reach_steps < 0)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->mode = MODE_REACH;
+            }
+            else if (strcmp(long_options[option_index].name, "would-split") == 0)
+            {
+                if (parse_cell(optarg, &opts->target_x, &opts->target_y) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->mode = MODE_WOULD_SPLIT;
+            }
+            else if (strcmp(long_options[option_index].name, "set") == 0)
+            {
+                if (opts->set_count >= MAX_SET_EDITS ||
+                    parse_edit(optarg, &opts->sets[opts->set_count]) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->set_count++;
+            }
+            else if (strcmp(long_options[option_index].name, "edits") == 0)
+            {
+                opts->edits_filename = optarg;
+            }
+            else if (strcmp(long_options[option_index].name, "components") == 0)
+            {
+                if (optarg != NULL && strcmp(optarg, "labels") != 0)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->dump_labels = optarg != NULL;
+                opts->mode = MODE_COMPONENTS;
+            }
+            else if (strcmp(long_options[option_index].name, "repair") == 0)
+            {
+                opts->mode = MODE_REPAIR;
+            }
+            else if (strcmp(long_options[option_index].name, "stats") == 0)
+            {
+                if (optarg != NULL && strcmp(optarg, "json") != 0)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->stats_format = optarg != NULL ? STATS_JSON : STATS_TEXT;
+            }
+            else if (strcmp(long_options[option_index].name, "diameter") == 0)
+            {
+                opts->mode = MODE_DIAMETER;
+            }
+            else if (strcmp(long_options[option_index].name, "generate") == 0)
+            {
+                // 列数是紧随其后的下一个参数
+                if (optind >= argc ||
+                    parse_long(optarg, 1, 1L << 30, &opts->generate.rows) != ERR_NONE ||
+                    parse_long(argv[optind], 1, 1L << 30, &opts->generate.cols) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                optind++;
+                opts->mode = MODE_GENERATE;
+            }
+            else if (strcmp(long_options[option_index].name, "seed") == 0)
+            {
+                long seed;
+                if (parse_long(optarg, 0, __LONG_MAX__, &seed) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->generate.seed = (uint64_t)seed;
+            }
+            else if (strcmp(long_options[option_index].name, "density") == 0)
+            {
+                long density;
+                if (parse_long(optarg, 0, 100, &density) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->generate.density = (int)density;
+            }
+            else if (strcmp(long_options[option_index].name, "players") == 0)
+            {
+                long players;
+                if (parse_long(optarg, 0, 9, &players) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->generate.players = (int)players;
+            }
+            else if (strcmp(long_options[option_index].name, "bench") == 0)
+            {
+                long runs = 51;
+                if (optarg != NULL && parse_long(optarg, 1, 100000, &runs) != ERR_NONE)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->bench_runs = (int)runs;
+                opts->mode = MODE_BENCH;
+            }
+            else if (strcmp(long_options[option_index].name, "script") == 0)
+            {
+                opts->script_filename = optarg;
+                opts->mode = MODE_SCRIPT;
+            }
+            else if (strcmp(long_options[option_index].name, "backend") == 0)
+            {
+                const MapBackendOps *ops = find_backend(optarg);
+                if (ops == NULL)
+                {
+                    return ERR_INVALID_ARGS;
+                }
+                opts->backend = strcmp(optarg, "grid") == 0 ? NULL : ops;
+            }
+            else if (strcmp(long_options[option_index].name, "stream-validate") == 0)
+            {
+                opts->mode = MODE_STREAM_VALIDATE;
+            }
+            break;
+        case '?':
+        default:
+            return ERR_INVALID_ARGS;
+        }
+    }
+
+    if (opts->mode == MODE_GENERATE || opts->mode == MODE_BENCH)
+    {
+        return ERR_NONE; // 生成与基准测试模式不读取地图，也不需要玩家
+    }
+    if (!has_map)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    // 协同规划与地图分析不针对单个玩家，不需要 -p；其余模式仍要求指定玩家
+    bool needs_player = opts->mode != MODE_PLAN && opts->mode != MODE_WOULD_SPLIT &&
+                        opts->mode != MODE_COMPONENTS && opts->mode != MODE_REPAIR &&
+                        opts->mode != MODE_DIAMETER && opts->mode != MODE_SCRIPT &&
+                        opts->mode != MODE_STREAM_VALIDATE;
+    if (needs_player && !has_player)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    if (opts->mode != MODE_PLAY && opts->move_direction != NULL)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    // --block 只在 --route 途中生效
+    if (opts->mode != MODE_ROUTE && opts->block_count > 0)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    // 替换后端只支持移动、打印与批处理命令
+    if (opts->backend != NULL &&
+        ((opts->mode != MODE_PLAY && opts->mode != MODE_SCRIPT) || opts->set_count > 0 || opts->edits_filename != NULL))
+    {
+        return ERR_INVALID_ARGS;
+    }
+    // --components 与 --repair 在验证和编辑之前就输出并退出，与 --set/--edits 同用会让编辑被忽略
+    bool before_edits = opts->mode == MODE_COMPONENTS || opts->mode == MODE_REPAIR;
+    if (before_edits && (opts->set_count > 0 || opts->edits_filename != NULL))
+    {
+        return ERR_INVALID_ARGS;
+    }
+    // stdin 只能提供一路输入
+    if (opts->mode == MODE_SCRIPT && strcmp(opts->map_filename, "-") == 0 &&
+        strcmp(opts->script_filename, "-") == 0)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    return ERR_NONE;
+}
+
+// 解析 "P=R,C" 形式的目标（行列均为 1 起始，与地图存储一致）
+ErrorCode parse_goal(const char *str, Goal *goal)
+{
+    char extra;
+    if (sscanf(str, "%d=%d,%d%c", &goal->player, &goal->x, &goal->y, &extra) != 3)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    if (goal->player < 0 || goal->player > 9)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    return ERR_NONE;
+}
+
+// 解析 [min, max] 范围内的十进制整数
+ErrorCode parse_long(const char *str, long min, long max, long *value)
+{
+    char *end;
+    *value = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || *value < min || *value > max)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    return ERR_NONE;
+}
+
+// 解析 "R,C" 形式的格子坐标（1 起始）
+ErrorCode parse_cell(const char *str, int *x, int *y)
+{
+    char extra;
+    if (sscanf(str, "%d,%d%c", x, y, &extra) != 2)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    return ERR_NONE;
+}
+
+// 解析 "K:R,C" 形式的动态障碍（K 为放置前已走的步数）
+ErrorCode parse_block(const char *str, RouteBlock *block)
+{
+    char extra;
+    if (sscanf(str, "%d:%d,%d%c", &block->step, &block->x, &block->y, &extra) != 3)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    if (block->step < 0)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    return ERR_NONE;
+}
+
+ErrorCode load_map(const char *filename, Map *map)
+{
+    LAB_PROBE1(load_map_start, filename);
+    FILE *fp = open_map_input(filename);
+    if (!fp)
+    {
+        LAB_PROBE3(load_map_done, ERR_MAP_NOT_FOUND, 0, 0);
         return ERR_MAP_NOT_FOUND;
     }
-    char buffer[1024];
-    map->rows = 0;
-    while (fgets(buffer, sizeof(buffer), fp) != NULL)
+    ErrorCode err = load_map_stream(fp, map);
+    close_map_input(fp);
+    LAB_PROBE3(load_map_done, err, map->rows, map->cols);
+    return err;
+}
+
+// 打开地图输入："-" 表示 stdin，便于生成器或解压程序通过管道直接喂给解析器
+FILE *open_map_input(const char *filename)
+{
+    if (strcmp(filename, "-") == 0)
+    {
+        return stdin;
+    }
+    return fopen(filename, "r");
+}
+
+void close_map_input(FILE *fp)
+{
+    if (fp != stdin)
+    {
+        fclose(fp);
+    }
+}
+
+// 从已打开的流中读取地图；gzip 与 RLE 格式由 read_map_input 透明解码
+ErrorCode load_map_stream(FILE *fp, Map *map)
+{
+    MapParser parser;
+    map_parser_init(&parser, map);
+    ErrorCode err = read_map_input(fp, map_parser_sink, &parser);
+    if (err != ERR_NONE)
+    {
+        return err;
+    }
+    err = map_parser_finish(&parser);
+    if (err == ERR_NONE)
+    {
+        map_build_neighbours(map);
+    }
+    return err;
+}
+
+// 字符到地形类别的查找表；非地形字符为 0（TERRAIN_PLAIN）
+static const unsigned char MAP_CHAR_TERRAIN[256] = {[','] = TERRAIN_MUD, ['~'] = TERRAIN_WATER};
+
+#define MAP_SCAN_BLOCK 32
+
+// 扫描 32 字节：返回换行符位置的位掩码，*bad 为不在 "#.,~0-9\n" 中的字节的位掩码
+static uint32_t map_scan_block(const char *p, uint32_t *bad)
+{
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    // 有符号比较：>= 0x80 的字节为负数，不会落在数字区间内
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i newline = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+    __m256i ok = _mm256_or_si256(digit, newline);
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')));
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')));
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('~')));
+    *bad = ~(uint32_t)_mm256_movemask_epi8(ok);
+    return (uint32_t)_mm256_movemask_epi8(newline);
+#elif defined(__SSE2__)
+    uint32_t newline_mask = 0, ok_mask = 0;
+    for (int half = 0; half < 2; half++)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * half));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+        __m128i newline = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+        __m128i ok = _mm_or_si128(digit, newline);
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('~')));
+        newline_mask |= (uint32_t)_mm_movemask_epi8(newline) << (16 * half);
+        ok_mask |= (uint32_t)_mm_movemask_epi8(ok) << (16 * half);
+    }
+    *bad = ~ok_mask;
+    return newline_mask;
+#else
+    uint32_t newline_mask = 0, bad_mask = 0;
+    for (int i = 0; i < MAP_SCAN_BLOCK; i++)
+    {
+        unsigned char c = (unsigned char)p[i];
+        bool ok = c == '#' || c == '.' || MAP_CHAR_TERRAIN[c] != 0 || (c >= '0' && c <= '9');
+        newline_mask |= (uint32_t)(c == '\n') << i;
+        bad_mask |= (uint32_t)(!ok && c != '\n') << i;
+    }
+    *bad = bad_mask;
+    return newline_mask;
+#endif
+}
+
+void map_parser_init(MapParser *parser, Map *map)
+{
+    parser->map = map;
+    parser->line_len = 0;
+    parser->saw_cr = false;
+    map->rows = 0;
+}
+
+// 处理一整行（不含 '\n'）：检查行长并按查找表写入 cells 与 terrain
+static ErrorCode map_parser_row(MapParser *parser, const char *row, size_t len)
+{
+    Map *map = parser->map;
+    if (parser->saw_cr)
+    {
+        // 与 trim_newline 一致：只去掉行尾的 '\r'，行中间的 '\r' 仍是非法字符
+        while (len > 0 && row[len - 1] == '\r')
+        {
+            len--;
+        }
+        if (memchr(row, '\r', len) != NULL)
+        {
+            return ERR_INVALID_MAP;
+        }
+    }
+    if (len == 0)
+    {
+        return ERR_NONE; // 跳过空行
+    }
+    if (map->rows == 0)
+    {
+        if (len > MAX_MAP_DIM)
+        {
+            return ERR_INVALID_MAP;
+        }
+        map->cols = (int)len;
+    }
+    else if ((int)len != map->cols)
+    {
+        return ERR_INVALID_MAP;
+    }
+    if (map->rows >= MAX_MAP_DIM)
+    {
+        return ERR_INVALID_MAP;
+    }
+    // 采用 1 索引存储，便于边界检查；地形格在 cells 中记为 '.'
+    int r = ++map->rows;
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)row[i];
+        unsigned char terrain = MAP_CHAR_TERRAIN[c];
+        map->cells[r][i + 1] = terrain ? '.' : (char)c;
+        map->terrain[r][i + 1] = terrain;
+    }
+    return ERR_NONE;
+}
+
+// 送入一块数据：每 32 字节一次完成换行定位与字符类检查，遇到换行即校验该行长度
+ErrorCode map_parser_feed(MapParser *parser, const char *data, size_t len)
+{
+    size_t line_start = 0;
+    for (size_t off = 0; off < len; off += MAP_SCAN_BLOCK)
+    {
+        const char *block = data + off;
+        char tail[MAP_SCAN_BLOCK];
+        size_t n = len - off < MAP_SCAN_BLOCK ? len - off : MAP_SCAN_BLOCK;
+        if (n < MAP_SCAN_BLOCK)
+        {
+            memset(tail, '#', sizeof(tail)); // 用合法字符填充末尾不足 32 字节的部分
+            memcpy(tail, block, n);
+            block = tail;
+        }
+        uint32_t bad;
+        uint32_t newlines = map_scan_block(block, &bad);
+        // '\r' 只允许出现在行尾，留给 map_parser_row 处理；其余非法字符直接失败
+        while (bad != 0)
+        {
+            if (block[__builtin_ctz(bad)] != '\r')
+            {
+                return ERR_INVALID_MAP;
+            }
+            parser->saw_cr = true;
+            bad &= bad - 1;
+        }
+        while (newlines != 0)
+        {
+            size_t end = off + (size_t)__builtin_ctz(newlines);
+            newlines &= newlines - 1;
+            const char *row = data + line_start;
+            size_t row_len = end - line_start;
+            if (parser->line_len > 0)
+            {
+                // 与上一块留下的半行拼接
+                if (parser->line_len + row_len > MAP_LINE_MAX)
+                {
+                    return ERR_INVALID_MAP;
+                }
+                memcpy(parser->line + parser->line_len, row, row_len);
+                row = parser->line;
+                row_len += parser->line_len;
+                parser->line_len = 0;
+            }
+            ErrorCode err = map_parser_row(parser, row, row_len);
+            if (err != ERR_NONE)
+            {
+                return err;
+            }
+            line_start = end + 1;
+        }
+    }
+    // 本块末尾没有换行的部分暂存，等待下一块
+    size_t rest = len - line_start;
+    if (parser->line_len + rest > MAP_LINE_MAX)
+    {
+        return ERR_INVALID_MAP;
+    }
+    memcpy(parser->line + parser->line_len, data + line_start, rest);
+    parser->line_len += rest;
+    return ERR_NONE;
+}
+
+// 输入结束：最后一行可以没有换行符
+ErrorCode map_parser_finish(MapParser *parser)
+{
+    size_t len = parser->line_len;
+    parser->line_len = 0;
+    return map_parser_row(parser, parser->line, len);
+}
+
+// 作为 read_map_input 的 sink 使用
+static ErrorCode map_parser_sink(void *ctx, const char *data, size_t len)
+{
+    return map_parser_feed(ctx, data, len);
+}
+
+// ---------------------------------------------------------------------------
+// 压缩地图输入
+//
+// read_map_input 根据开头的字节识别格式，把解码后的文本按块交给 sink：
+//   gzip     以 1f 8b 开头，内置 inflate 解码（RFC 1951/1952），校验 CRC32 与长度，
+//            支持多个成员拼接
+//   RLE 文本 首行为 "!rle"，其后为若干 [次数]记号，记号为 '#' '.' ',' '~'、
+//            换行，或 'p' 加一位数字表示玩家；次数省略时为 1，'\r' 被忽略
+//   其余按普通文本原样传递
+// 压缩格式在单独的线程中解码，通过有界的块队列与解析并行（Windows 上串行执行）。
+// ---------------------------------------------------------------------------
+
+static int reader_byte(ByteReader *r)
+{
+    if (r->pos == r->len)
+    {
+        r->len = fread(r->buf, 1, sizeof(r->buf), r->fp);
+        r->pos = 0;
+        if (r->len == 0)
+        {
+            return -1;
+        }
+    }
+    return r->buf[r->pos++];
+}
+
+// 解码输出：攒满一块再交给 sink
+typedef struct
+{
+    TextSink sink;
+    void *ctx;
+    ErrorCode err;
+    size_t len;
+    char buf[1 << 15];
+} TextOut;
+
+static void text_out_flush(TextOut *out)
+{
+    if (out->len > 0 && out->err == ERR_NONE)
+    {
+        out->err = out->sink(out->ctx, out->buf, out->len);
+    }
+    out->len = 0;
+}
+
+static void text_out_byte(TextOut *out, char c)
+{
+    out->buf[out->len++] = c;
+    if (out->len == sizeof(out->buf))
+    {
+        text_out_flush(out);
+    }
+}
+
+// CRC32（IEEE，反射多项式 0xEDB88320），查表法，一次处理整段缓冲区
+static uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t len)
+{
+    static uint32_t table[256];
+    static bool ready = false;
+    if (!ready)
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+            {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        ready = true;
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// 范式 Huffman 码表：count[len] 为各码长的符号数，symbol 按码值顺序排列
+typedef struct
+{
+    short count[16];
+    short symbol[288];
+} Huffman;
+
+#define INFLATE_WINDOW 32768
+
+typedef struct
+{
+    ByteReader *in;
+    uint32_t bitbuf;
+    int bitcnt;
+    bool eof;
+    unsigned char window[INFLATE_WINDOW]; // 最近输出的 32 KB，供回溯复制
+    size_t total;                         // 当前成员已输出的字节数
+    size_t crc_total;                     // 已计入 crc 的字节数，总是 INFLATE_WINDOW 的整数倍
+    uint32_t crc;
+    TextOut *out;
+} Inflater;
+
+// 把窗口中尚未计入的输出整段加入 CRC：窗口每写满一圈时和成员结束时调用
+static void inflate_crc_sync(Inflater *s)
+{
+    s->crc = crc32_update(s->crc, s->window, s->total - s->crc_total);
+    s->crc_total = s->total;
+}
+
+static void inflate_put(Inflater *s, unsigned char c)
+{
+    s->window[s->total++ & (INFLATE_WINDOW - 1)] = c;
+    if ((s->total & (INFLATE_WINDOW - 1)) == 0)
+    {
+        inflate_crc_sync(s); // 下一个字节将覆盖窗口开头
+    }
+    text_out_byte(s->out, (char)c);
+}
+
+// 按 LSB 优先读取 need 位；数据提前结束时置 eof 并返回 0
+static int inflate_bits(Inflater *s, int need)
+{
+    uint32_t val = s->bitbuf;
+    while (s->bitcnt < need)
+    {
+        int byte = reader_byte(s->in);
+        if (byte < 0)
+        {
+            s->eof = true;
+            return 0;
+        }
+        val |= (uint32_t)byte << s->bitcnt;
+        s->bitcnt += 8;
+    }
+    s->bitbuf = val >> need;
+    s->bitcnt -= need;
+    return (int)(val & ((1u << need) - 1));
+}
+
+// 由码长构造码表；返回 0 表示完整，负数表示码长超额（非法），正数表示不完整
+static int huffman_build(Huffman *h, const short *length, int n)
+{
+    short offs[16];
+    memset(h->count, 0, sizeof(h->count));
+    for (int sym = 0; sym < n; sym++)
+    {
+        h->count[length[sym]]++;
+    }
+    if (h->count[0] == n)
+    {
+        return 0; // 没有任何码，只在 distance 表中出现，由调用方判断
+    }
+    int left = 1;
+    for (int len = 1; len < 16; len++)
+    {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0)
+        {
+            return left;
+        }
+    }
+    offs[1] = 0;
+    for (int len = 1; len < 15; len++)
+    {
+        offs[len + 1] = offs[len] + h->count[len];
+    }
+    for (int sym = 0; sym < n; sym++)
+    {
+        if (length[sym] != 0)
+        {
+            h->symbol[offs[length[sym]]++] = (short)sym;
+        }
+    }
+    return left;
+}
+
+// 逐位解码一个符号；无效码返回 -1
+static int huffman_decode(Inflater *s, const Huffman *h)
+{
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; len++)
+    {
+        code |= inflate_bits(s, 1);
+        if (s->eof)
+        {
+            return -1;
+        }
+        int count = h->count[len];
+        if (code - count < first)
+        {
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static const short LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const short LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                       3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const short DIST_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                    6145, 8193, 12289, 16385, 24577};
+static const short DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                     6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// 用给定码表解码一个压缩块的数据，直到块结束符 256
+static ErrorCode inflate_codes(Inflater *s, const Huffman *lencode, const Huffman *distcode)
+{
+    for (;;)
+    {
+        int sym = huffman_decode(s, lencode);
+        if (sym < 0 || s->out->err != ERR_NONE)
+        {
+            return s->out->err != ERR_NONE ? s->out->err : ERR_INVALID_MAP;
+        }
+        if (sym < 256)
+        {
+            inflate_put(s, (unsigned char)sym);
+            continue;
+        }
+        if (sym == 256)
+        {
+            return ERR_NONE;
+        }
+        sym -= 257;
+        if (sym >= 29)
+        {
+            return ERR_INVALID_MAP;
+        }
+        int len = LENGTH_BASE[sym] + inflate_bits(s, LENGTH_EXTRA[sym]);
+        int dsym = huffman_decode(s, distcode);
+        if (dsym < 0 || dsym >= 30)
+        {
+            return ERR_INVALID_MAP;
+        }
+        size_t dist = (size_t)DIST_BASE[dsym] + (size_t)inflate_bits(s, DIST_EXTRA[dsym]);
+        if (s->eof || dist > s->total || dist > INFLATE_WINDOW)
+        {
+            return ERR_INVALID_MAP;
+        }
+        while (len-- > 0)
+        {
+            inflate_put(s, s->window[(s->total - dist) & (INFLATE_WINDOW - 1)]);
+        }
+    }
+}
+
+static ErrorCode inflate_stored(Inflater *s)
+{
+    s->bitbuf = 0; // 丢弃到字节边界
+    s->bitcnt = 0;
+    int b[4];
+    for (int k = 0; k < 4; k++)
+    {
+        b[k] = reader_byte(s->in);
+        if (b[k] < 0)
+        {
+            return ERR_INVALID_MAP;
+        }
+    }
+    unsigned len = (unsigned)(b[0] | b[1] << 8);
+    if (len != (~(unsigned)(b[2] | b[3] << 8) & 0xFFFF))
+    {
+        return ERR_INVALID_MAP;
+    }
+    while (len-- > 0)
+    {
+        int c = reader_byte(s->in);
+        if (c < 0)
+        {
+            return ERR_INVALID_MAP;
+        }
+        inflate_put(s, (unsigned char)c);
+    }
+    return s->out->err;
+}
+
+static ErrorCode inflate_fixed(Inflater *s)
+{
+    static Huffman lencode, distcode;
+    static bool ready = false;
+    if (!ready)
+    {
+        short lengths[288];
+        for (int sym = 0; sym < 288; sym++)
+        {
+            lengths[sym] = sym < 144 ? 8 : sym < 256 ? 9 : sym < 280 ? 7 : 8;
+        }
+        huffman_build(&lencode, lengths, 288);
+        for (int sym = 0; sym < 30; sym++)
+        {
+            lengths[sym] = 5;
+        }
+        huffman_build(&distcode, lengths, 30);
+        ready = true;
+    }
+    return inflate_codes(s, &lencode, &distcode);
+}
+
+static ErrorCode inflate_dynamic(Inflater *s)
+{
+    static const short ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    short lengths[320];
+    Huffman lencode, distcode;
+    int nlen = inflate_bits(s, 5) + 257;
+    int ndist = inflate_bits(s, 5) + 1;
+    int ncode = inflate_bits(s, 4) + 4;
+    if (s->eof || nlen > 286 || ndist > 30)
+    {
+        return ERR_INVALID_MAP;
+    }
+    for (int k = 0; k < 19; k++)
+    {
+        lengths[ORDER[k]] = k < ncode ? (short)inflate_bits(s, 3) : 0;
+    }
+    if (huffman_build(&lencode, lengths, 19) != 0)
+    {
+        return ERR_INVALID_MAP; // 码长码必须完整
+    }
+    int index = 0;
+    while (index < nlen + ndist)
+    {
+        int sym = huffman_decode(s, &lencode);
+        if (sym < 0)
+        {
+            return ERR_INVALID_MAP;
+        }
+        if (sym < 16)
+        {
+            lengths[index++] = (short)sym;
+            continue;
+        }
+        short len = 0;
+        int repeat;
+        if (sym == 16)
+        {
+            if (index == 0)
+            {
+                return ERR_INVALID_MAP;
+            }
+            len = lengths[index - 1];
+            repeat = 3 + inflate_bits(s, 2);
+        }
+        else if (sym == 17)
+        {
+            repeat = 3 + inflate_bits(s, 3);
+        }
+        else
+        {
+            repeat = 11 + inflate_bits(s, 7);
+        }
+        if (s->eof || index + repeat > nlen + ndist)
+        {
+            return ERR_INVALID_MAP;
+        }
+        while (repeat-- > 0)
+        {
+            lengths[index++] = len;
+        }
+    }
+    if (lengths[256] == 0)
+    {
+        return ERR_INVALID_MAP; // 必须有块结束符
+    }
+    // 不完整的码表只允许是单个码
+    int err = huffman_build(&lencode, lengths, nlen);
+    if (err < 0 || (err > 0 && nlen - lencode.count[0] != 1))
+    {
+        return ERR_INVALID_MAP;
+    }
+    err = huffman_build(&distcode, lengths + nlen, ndist);
+    if (err < 0 || (err > 0 && ndist - distcode.count[0] != 1))
+    {
+        return ERR_INVALID_MAP;
+    }
+    return inflate_codes(s, &lencode, &distcode);
+}
+
+static int reader_u32le(ByteReader *r, uint32_t *value)
+{
+    *value = 0;
+    for (int k = 0; k < 4; k++)
+    {
+        int c = reader_byte(r);
+        if (c < 0)
+        {
+            return -1;
+        }
+        *value |= (uint32_t)c << (8 * k);
+    }
+    return 0;
+}
+
+// 跳过 gzip 头（魔数已读）；只接受 deflate 压缩方法
+static ErrorCode gzip_header(ByteReader *r)
+{
+    int method = reader_byte(r);
+    int flags = reader_byte(r);
+    if (method != 8 || flags < 0 || (flags & 0xE0) != 0)
+    {
+        return ERR_INVALID_MAP;
+    }
+    for (int k = 0; k < 6; k++) // MTIME、XFL、OS
+    {
+        if (reader_byte(r) < 0)
+        {
+            return ERR_INVALID_MAP;
+        }
+    }
+    if (flags & 0x04) // FEXTRA
+    {
+        int lo = reader_byte(r), hi = reader_byte(r);
+        if (lo < 0 || hi < 0)
+        {
+            return ERR_INVALID_MAP;
+        }
+        for (int k = lo | hi << 8; k > 0; k--)
+        {
+            if (reader_byte(r) < 0)
+            {
+                return ERR_INVALID_MAP;
+            }
+        }
+    }
+    for (int field = 0x08; field <= 0x10; field <<= 1) // FNAME、FCOMMENT：以 0 结尾
+    {
+        if (flags & field)
+        {
+            int c;
+            while ((c = reader_byte(r)) > 0)
+            {
+            }
+            if (c < 0)
+            {
+                return ERR_INVALID_MAP;
+            }
+        }
+    }
+    if ((flags & 0x02) && (reader_byte(r) < 0 || reader_byte(r) < 0)) // FHCRC
+    {
+        return ERR_INVALID_MAP;
+    }
+    return ERR_NONE;
+}
+
+// 解码 gzip 流（可能由多个成员拼接而成）
+static ErrorCode decode_gzip(ByteReader *r, TextOut *out)
+{
+    Inflater *s = malloc(sizeof(Inflater));
+    if (s == NULL)
+    {
+        return ERR_MEMORY;
+    }
+    s->in = r;
+    s->out = out;
+    ErrorCode err = ERR_NONE;
+    int c1 = reader_byte(r);
+    while (err == ERR_NONE && c1 >= 0)
+    {
+        if (c1 != 0x1f || reader_byte(r) != 0x8b)
+        {
+            err = ERR_INVALID_MAP;
+            break;
+        }
+        err = gzip_header(r);
+        s->bitbuf = 0;
+        s->bitcnt = 0;
+        s->eof = false;
+        s->total = 0;
+        s->crc_total = 0;
+        s->crc = 0;
+        int last = 0;
+        while (err == ERR_NONE && !last)
+        {
+            last = inflate_bits(s, 1);
+            int type = inflate_bits(s, 2);
+            if (s->eof)
+            {
+                err = ERR_INVALID_MAP;
+            }
+            else if (type == 0)
+            {
+                err = inflate_stored(s);
+            }
+            else if (type == 1)
+            {
+                err = inflate_fixed(s);
+            }
+            else if (type == 2)
+            {
+                err = inflate_dynamic(s);
+            }
+            else
+            {
+                err = ERR_INVALID_MAP;
+            }
+        }
+        // 成员尾部：CRC32 与原始长度（模 2^32），从字节边界开始
+        inflate_crc_sync(s);
+        uint32_t crc, size;
+        if (err == ERR_NONE &&
+            (reader_u32le(r, &crc) < 0 || reader_u32le(r, &size) < 0 ||
+             crc != s->crc || size != (uint32_t)s->total))
+        {
+            err = ERR_INVALID_MAP;
+        }
+        c1 = reader_byte(r);
+    }
+    free(s);
+    return err;
+}
+
+// 解码 RLE 文本（"!rle" 首行已读）
+static ErrorCode decode_rle(ByteReader *r, TextOut *out)
+{
+    long count = -1;
+    int c;
+    while ((c = reader_byte(r)) >= 0 && out->err == ERR_NONE)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            count = (count < 0 ? 0 : count) * 10 + (c - '0');
+            if (count > (1L << 30))
+            {
+                return ERR_INVALID_MAP;
+            }
+            continue;
+        }
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c == 'p')
+        {
+            c = reader_byte(r);
+            if (c < '0' || c > '9')
+            {
+                return ERR_INVALID_MAP;
+            }
+        }
+        else if (c != '#' && c != '.' && c != ',' && c != '~' && c != '\n')
+        {
+            return ERR_INVALID_MAP;
+        }
+        // 次数最大可达 2^30：sink 出错后立即停止展开
+        for (long k = count < 0 ? 1 : count; k > 0 && out->err == ERR_NONE; k--)
+        {
+            text_out_byte(out, (char)c);
+        }
+        count = -1;
+    }
+    if (count >= 0)
+    {
+        return ERR_INVALID_MAP; // 次数后缺少记号
+    }
+    return out->err;
+}
+
+typedef ErrorCode (*MapDecoder)(ByteReader *r, TextOut *out);
+
+static ErrorCode run_decoder(MapDecoder decoder, ByteReader *r, TextSink sink, void *ctx)
+{
+    TextOut *out = malloc(sizeof(TextOut));
+    if (out == NULL)
+    {
+        return ERR_MEMORY;
+    }
+    out->sink = sink;
+    out->ctx = ctx;
+    out->err = ERR_NONE;
+    out->len = 0;
+    ErrorCode err = decoder(r, out);
+    text_out_flush(out);
+    if (err == ERR_NONE)
+    {
+        err = out->err;
+    }
+    free(out);
+    return err;
+}
+
+#ifndef _WIN32
+// 解码线程与解析线程之间的有界块队列：生产者填满一块后入队，消费者逐块取出
+#define PIPE_BLOCKS 4
+#define PIPE_BLOCK_SIZE (1 << 16)
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char data[PIPE_BLOCKS][PIPE_BLOCK_SIZE];
+    size_t len[PIPE_BLOCKS];
+    int head;  // 消费者下一个要取的块
+    int count; // 已入队（含消费者正在处理）的块数
+    int fill;  // 生产者正在填充的块，-1 表示尚未取得
+    bool done;
+    bool cancelled; // 消费者出错后通知生产者停止
+    ErrorCode err;  // 解码结果
+    MapDecoder decoder;
+    ByteReader *reader;
+} TextPipe;
+
+// 生产者侧 sink：把解码出的文本拷入当前块，满了就入队
+static ErrorCode pipe_push(void *ctx, const char *data, size_t len)
+{
+    TextPipe *pipe = ctx;
+    while (len > 0)
+    {
+        if (pipe->fill < 0)
+        {
+            pthread_mutex_lock(&pipe->lock);
+            while (pipe->count == PIPE_BLOCKS && !pipe->cancelled)
+            {
+                pthread_cond_wait(&pipe->cond, &pipe->lock);
+            }
+            bool cancelled = pipe->cancelled;
+            pipe->fill = (pipe->head + pipe->count) % PIPE_BLOCKS;
+            pthread_mutex_unlock(&pipe->lock);
+            if (cancelled)
+            {
+                return ERR_INVALID_MAP;
+            }
+            pipe->len[pipe->fill] = 0;
+        }
+        size_t room = PIPE_BLOCK_SIZE - pipe->len[pipe->fill];
+        size_t n = len < room ? len : room;
+        memcpy(pipe->data[pipe->fill] + pipe->len[pipe->fill], data, n);
+        pipe->len[pipe->fill] += n;
+        data += n;
+        len -= n;
+        if (pipe->len[pipe->fill] == PIPE_BLOCK_SIZE)
+        {
+            pthread_mutex_lock(&pipe->lock);
+            pipe->count++;
+            pipe->fill = -1;
+            pthread_cond_broadcast(&pipe->cond);
+            pthread_mutex_unlock(&pipe->lock);
+        }
+    }
+    return ERR_NONE;
+}
+
+static void *pipe_producer(void *arg)
+{
+    TextPipe *pipe = arg;
+    ErrorCode err = run_decoder(pipe->decoder, pipe->reader, pipe_push, pipe);
+    pthread_mutex_lock(&pipe->lock);
+    if (pipe->fill >= 0)
+    {
+        pipe->count++; // 最后一块未满也要交出
+        pipe->fill = -1;
+    }
+    pipe->err = err;
+    pipe->done = true;
+    pthread_cond_broadcast(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+// 在单独的线程中解码，当前线程逐块把文本交给 sink
+static ErrorCode run_decoder_pipelined(MapDecoder decoder, ByteReader *r, TextSink sink, void *ctx)
+{
+    TextPipe *pipe = malloc(sizeof(TextPipe));
+    if (pipe == NULL)
+    {
+        return run_decoder(decoder, r, sink, ctx);
+    }
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+    pipe->head = 0;
+    pipe->count = 0;
+    pipe->fill = -1;
+    pipe->done = false;
+    pipe->cancelled = false;
+    pipe->err = ERR_NONE;
+    pipe->decoder = decoder;
+    pipe->reader = r;
+    pthread_t producer;
+    if (pthread_create(&producer, NULL, pipe_producer, pipe) != 0)
+    {
+        free(pipe);
+        return run_decoder(decoder, r, sink, ctx);
+    }
+
+    ErrorCode err = ERR_NONE;
+    for (;;)
+    {
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->count == 0 && !pipe->done)
+        {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        if (pipe->count == 0)
+        {
+            pthread_mutex_unlock(&pipe->lock);
+            break; // 生产者已结束且队列已空
+        }
+        int block = pipe->head;
+        pthread_mutex_unlock(&pipe->lock);
+
+        err = sink(ctx, pipe->data[block], pipe->len[block]);
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->head = (pipe->head + 1) % PIPE_BLOCKS;
+        pipe->count--;
+        pipe->cancelled = err != ERR_NONE;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+        if (err != ERR_NONE)
+        {
+            break;
+        }
+    }
+    pthread_join(producer, NULL);
+    if (err == ERR_NONE)
+    {
+        err = pipe->err;
+    }
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->cond);
+    free(pipe);
+    return err;
+}
+#endif
+
+// 识别输入格式并把解码后的地图文本交给 sink
+ErrorCode read_map_input(FILE *fp, TextSink sink, void *ctx)
+{
+    ByteReader *r = malloc(sizeof(ByteReader));
+    if (r == NULL)
+    {
+        return ERR_MEMORY;
+    }
+    r->fp = fp;
+    r->pos = 0;
+    r->len = fread(r->buf, 1, sizeof(r->buf), fp);
+
+    MapDecoder decoder = NULL;
+    if (r->len >= 2 && r->buf[0] == 0x1f && r->buf[1] == 0x8b)
+    {
+        decoder = decode_gzip;
+    }
+    else if (r->len >= 5 && memcmp(r->buf, "!rle", 4) == 0 && (r->buf[4] == '\n' || r->buf[4] == '\r'))
+    {
+        decoder = decode_rle;
+        while (r->pos < r->len && r->buf[r->pos++] != '\n')
+        {
+            // 跳过首行（含换行符）
+        }
+    }
+
+    ErrorCode err = ERR_NONE;
+    if (decoder != NULL)
+    {
+#ifdef _WIN32
+        err = run_decoder(decoder, r, sink, ctx);
+#else
+        err = run_decoder_pipelined(decoder, r, sink, ctx);
+#endif
+    }
+    else
+    {
+        while (err == ERR_NONE && r->len > 0)
+        {
+            err = sink(ctx, (const char *)r->buf, r->len);
+            r->len = fread(r->buf, 1, sizeof(r->buf), fp);
+        }
+    }
+    if (err == ERR_NONE && ferror(fp))
+    {
+        err = ERR_MAP_NOT_FOUND;
+    }
+    free(r);
+    return err;
+}
+
+
+// 在 validate_map 中进行空区域检查；stats 非空时顺带统计唯一空区域的形状
+ErrorCode validate_map(const Map *map, AreaStats *stats)
+{
+    int visited[MAX_ROWS][MAX_COLS] = {0};
+    int empty_area_count = 0;
+    if (stats != NULL)
+    {
+        *stats = (AreaStats){0, 0, 0, 0, map->rows + 1, 0, map->cols + 1, 0};
+    }
+    LAB_PROBE2(validate_start, map->rows, map->cols);
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (is_empty(i, j, map) && !visited[i][j])
+            {
+#ifdef LABYRINTH_USDT
+                long visited_before = run_stats.cells_visited;
+#endif
+                LAB_PROBE2(component_start, i, j);
+                deep_search(i, j, visited, map, stats);
+                LAB_PROBE3(component_done, i, j, run_stats.cells_visited - visited_before);
+                empty_area_count++;
+                if (empty_area_count > 1)
+                {
+                    LAB_PROBE2(validate_done, ERR_MULTIPLE_EMPTY_AREAS, empty_area_count);
+                    return ERR_MULTIPLE_EMPTY_AREAS;
+                }
+            }
+        }
+    }
+    LAB_PROBE2(validate_done, ERR_NONE, empty_area_count);
+    return ERR_NONE;
+}
+
+void deep_search(int x, int y, int visited[MAX_ROWS][MAX_COLS], const Map *map, AreaStats *stats)
+{
+    unsigned open = NEIGHBOUR_EMPTY(map->neighbours[x][y]);
+    int degree = __builtin_popcount(open);
+    visited[x][y] = 1;
+    run_stats.cells_visited++;
+    if (++run_stats.depth > run_stats.max_depth)
+    {
+        run_stats.max_depth = run_stats.depth;
+    }
+    // 掩码已排除地图外与非空的邻居
+    for (int i = 0; i < 4; i++)
+    {
+        int nx = x + DIR_DX[i], ny = y + DIR_DY[i];
+        if ((open >> i & 1) && !visited[nx][ny])
+        {
+            deep_search(nx, ny, visited, map, stats);
+        }
+    }
+    if (stats != NULL)
+    {
+        stats->cells++;
+        stats->perimeter += 4 - degree;
+        stats->dead_ends += degree == 1;
+        stats->junctions += degree >= 3;
+        stats->min_x = x < stats->min_x ? x : stats->min_x;
+        stats->max_x = x > stats->max_x ? x : stats->max_x;
+        stats->min_y = y < stats->min_y ? y : stats->min_y;
+        stats->max_y = y > stats->max_y ? y : stats->max_y;
+    }
+    run_stats.depth--;
+}
+
+// 以 "键 值" 的形式输出空区域统计
+void print_area_stats(FILE *out, const AreaStats *stats)
+{
+    fprintf(out, "area_cells %d\n", stats->cells);
+    fprintf(out, "area_perimeter %d\n", stats->perimeter);
+    fprintf(out, "area_dead_ends %d\n", stats->dead_ends);
+    fprintf(out, "area_junctions %d\n", stats->junctions);
+    if (stats->cells > 0)
+    {
+        fprintf(out, "area_bbox %d,%d-%d,%d\n", stats->min_x, stats->min_y, stats->max_x, stats->max_y);
+    }
+}
+
+// atexit 回调：把插桩数据输出到 stderr，不影响 stdout 上的地图
+void print_run_stats(void)
+{
+    const RunStats *rs = &run_stats;
+    long rss = peak_rss_kb();
+    fflush(stdout); // 先输出地图，再输出报告
+    if (rs->format == STATS_JSON)
+    {
+        fprintf(stderr, "{\"parse_us\":%.3f,\"validate_us\":%.3f,\"move_us\":%.3f,\"moves\":%ld,\"print_us\":%.3f,",
+                rs->parse_ns / 1e3, rs->validate_ns / 1e3, rs->move_ns / 1e3, rs->moves, rs->print_ns / 1e3);
+        fprintf(stderr, "\"cells_visited\":%ld,\"max_depth\":%d,\"peak_rss_kb\":%ld",
+                rs->cells_visited, rs->max_depth, rss);
+        if (rs->has_area)
+        {
+            const AreaStats *a = &rs->area;
+            fprintf(stderr, ",\"area\":{\"cells\":%d,\"perimeter\":%d,\"dead_ends\":%d,\"junctions\":%d",
+                    a->cells, a->perimeter, a->dead_ends, a->junctions);
+            if (a->cells > 0)
+            {
+                fprintf(stderr, ",\"bbox\":[%d,%d,%d,%d]", a->min_x, a->min_y, a->max_x, a->max_y);
+            }
+            fprintf(stderr, "}");
+        }
+        fprintf(stderr, "}\n");
+        return;
+    }
+    fprintf(stderr, "parse_us %.3f\n", rs->parse_ns / 1e3);
+    fprintf(stderr, "validate_us %.3f\n", rs->validate_ns / 1e3);
+    fprintf(stderr, "move_us %.3f\n", rs->move_ns / 1e3);
+    fprintf(stderr, "moves %ld\n", rs->moves);
+    fprintf(stderr, "print_us %.3f\n", rs->print_ns / 1e3);
+    fprintf(stderr, "cells_visited %ld\n", rs->cells_visited);
+    fprintf(stderr, "max_depth %d\n", rs->max_depth);
+    fprintf(stderr, "peak_rss_kb %ld\n", rss);
+    if (rs->has_area)
+    {
+        print_area_stats(stderr, &rs->area);
+    }
+}
+
+// 进程的峰值常驻内存（KB），无法获取时返回 -1
+long peak_rss_kb(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return (long)(counters.PeakWorkingSetSize / 1024);
+    }
+    return -1;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return -1;
+    }
+    return usage.ru_maxrss; // Linux 上单位为 KB
+#endif
+}
+
+bool is_empty(int x, int y, const Map *map)
+{
+    // 注意：这里认为空地为 '.' 或者玩家（'1'-'9'）所在位置，
+    // 主要用于连通区域搜索；而在移动时，仅允许移动到 '.' 的位置
+    return (map->cells[x][y] == '.' || is_player(x, y, map, -1));
+}
+
+bool is_player(int x, int y, const Map *map, int player)
+{
+    if (player == -1)
+    {
+        return map->cells[x][y] >= '1' && map->cells[x][y] <= '9';
+    }
+    return map->cells[x][y] == (player + '0');
+}
+
+void print_map(const Map *map)
+{
+    uint64_t start = now_ns();
+    fprint_map(stdout, map);
+    uint64_t elapsed = now_ns() - start;
+    run_stats.print_ns += elapsed;
+    latency_record(LATENCY_PRINT, elapsed);
+}
+
+void fprint_map(FILE *out, const Map *map)
+{
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            char c = map->cells[i][j];
+            fputc(c == '.' ? TERRAIN_CHARS[map->terrain[i][j]] : c, out);
+        }
+        fputc('\n', out);
+    }
+}
+
+void trim_newline(char *str)
+{
+    size_t len = strlen(str);
+    while (len > 0 && (str[len - 1] == '\n' || str[len - 1] == '\r'))
+    {
+        str[len - 1] = '\0';
+        len--;
+    }
+}
+
+// 根据 direction 移动指定玩家，并把耗时计入插桩数据
+ErrorCode move_player(Map *map, int player, const char *direction)
+{
+    int x = -1, y = -1;
+    LAB_PROBE2(move_start, player, direction);
+    uint64_t start = now_ns();
+    ErrorCode err = move_player_once(map, player, direction, &x, &y);
+    uint64_t elapsed = now_ns() - start;
+    run_stats.move_ns += elapsed;
+    run_stats.moves++;
+    latency_record(LATENCY_MOVE, elapsed);
+    LAB_PROBE4(move_done, player, err, x, y);
+    return err;
+}
+
+// x, y 返回移动后玩家所在位置（玩家不存在且无法放置时为 -1）
+static ErrorCode move_player_once(Map *map, int player, const char *direction, int *x, int *y)
+{
+    int dir = parse_direction(direction);
+    if (dir < 0)
+    {
+        return ERR_MOVE_FAILED; // 无效的移动方向
+    }
+    int dx = DIR_DX[dir], dy = DIR_DY[dir];
+
+    char playerChar = player + '0';
+    int current_x = -1, current_y = -1;
+    // 搜索地图中是否存在该玩家（找到后即使移动失败也报告当前位置）
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (map->cells[i][j] == playerChar)
+            {
+                current_x = i;
+                current_y = j;
+                break;
+            }
+        }
+        if (current_x != -1)
+        {
+            break;
+        }
+    }
+    *x = current_x;
+    *y = current_y;
+
+    // 如果地图中没有该玩家，则将玩家放置在第一个空地
+    if (current_x == -1)
+    {
+        for (int i = 1; i <= map->rows; i++)
+        {
+            for (int j = 1; j <= map->cols; j++)
+            {
+                if (map->cells[i][j] == '.')
+                {
+                    set_cell(map, i, j, playerChar);
+                    *x = i;
+                    *y = j;
+                    return ERR_NONE;
+                }
+            }
+        }
+        return ERR_MOVE_FAILED; // 没有空地放置
+    }
+
+    int target_x = current_x + dx;
+    int target_y = current_y + dy;
+    // 目标位置必须在地图范围内且为空白（即 '.'），由邻居掩码一次判断
+    if (!(NEIGHBOUR_FREE(map->neighbours[current_x][current_y]) >> dir & 1))
+    {
+        return ERR_MOVE_FAILED;
+    }
+
+    // 执行移动：原位置置为 '.'，目标位置放置玩家
+    set_cell(map, current_x, current_y, '.');
+    set_cell(map, target_x, target_y, playerChar);
+    *x = target_x;
+    *y = target_y;
+    return ERR_NONE;
+}
+
+static CellObserver cell_observers[MAX_CELL_OBSERVERS];
+static void *cell_observer_ctx[MAX_CELL_OBSERVERS];
+static int cell_observer_count = 0;
+
+// 格子 (x, y) 在邻居掩码中的两位：is_empty 与是否为 '.'
+static unsigned neighbour_bits(char c, int dir)
+{
+    bool empty = c == '.' || (c >= '1' && c <= '9'); // 与 is_empty 一致
+    return (unsigned)empty << dir | (unsigned)(c == '.') << (dir + 4);
+}
+
+// 加载后重建整张地图的邻居掩码
+void map_build_neighbours(Map *map)
+{
+    memset(map->neighbours, 0, sizeof(map->neighbours));
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            unsigned mask = 0;
+            for (int d = 0; d < 4; d++)
+            {
+                int nx = i + DIR_DX[d], ny = j + DIR_DY[d];
+                if (nx >= 1 && nx <= map->rows && ny >= 1 && ny <= map->cols)
+                {
+                    mask |= neighbour_bits(map->cells[nx][ny], d);
+                }
+            }
+            map->neighbours[i][j] = (unsigned char)mask;
+        }
+    }
+}
+
+// 所有地图修改的统一入口：写入格子、更新四个邻居的掩码后通知观察者
+void set_cell(Map *map, int x, int y, char c)
+{
+    char old_cell = map->cells[x][y];
+    if (old_cell == c)
+    {
+        return;
+    }
+    map->cells[x][y] = c;
+    for (int d = 0; d < 4; d++)
+    {
+        // 邻居看向 (x, y) 的方向是 d 的反方向 d ^ 1
+        int nx = x + DIR_DX[d], ny = y + DIR_DY[d];
+        if (nx >= 1 && nx <= map->rows && ny >= 1 && ny <= map->cols)
+        {
+            unsigned clear = neighbour_bits('.', d ^ 1);
+            map->neighbours[nx][ny] =
+                (unsigned char)((map->neighbours[nx][ny] & ~clear) | neighbour_bits(c, d ^ 1));
+        }
+    }
+    for (int i = 0; i < cell_observer_count; i++)
+    {
+        cell_observers[i](cell_observer_ctx[i], map, x, y, old_cell);
+    }
+}
+
+void add_cell_observer(CellObserver observer, void *ctx)
+{
+    if (cell_observer_count < MAX_CELL_OBSERVERS)
+    {
+        cell_observers[cell_observer_count] = observer;
+        cell_observer_ctx[cell_observer_count] = ctx;
+        cell_observer_count++;
+    }
+}
+
+void remove_cell_observer(CellObserver observer, void *ctx)
+{
+    for (int i = 0; i < cell_observer_count; i++)
+    {
+        if (cell_observers[i] == observer && cell_observer_ctx[i] == ctx)
+        {
+            cell_observer_count--;
+            cell_observers[i] = cell_observers[cell_observer_count];
+            cell_observer_ctx[i] = cell_observer_ctx[cell_observer_count];
+            return;
+        }
+    }
+}
+
+// 将方向字符串转换为方向下标，无效时返回 -1
+int parse_direction(const char *direction)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        if (strcmp(direction, DIR_NAMES[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 从 (sx, sy) 出发在空地上做 BFS，dist 中不可达的位置为 -1
+void bfs_distances(const Map *map, int sx, int sy, int dist[MAX_ROWS][MAX_COLS])
+{
+    static int queue[MAX_ROWS * MAX_COLS];
+    for (int i = 0; i < MAX_ROWS; i++)
+    {
+        for (int j = 0; j < MAX_COLS; j++)
+        {
+            dist[i][j] = -1;
+        }
+    }
+    int head = 0, tail = 0;
+    dist[sx][sy] = 0;
+    queue[tail++] = sx * MAX_COLS + sy;
+    while (head < tail)
+    {
+        int x = queue[head] / MAX_COLS, y = queue[head] % MAX_COLS;
+        head++;
+        for (int d = 0; d < 4; d++)
+        {
+            int nx = x + DIR_DX[d], ny = y + DIR_DY[d];
+            if (nx < 1 || nx > map->rows || ny < 1 || ny > map->cols)
+            {
+                continue;
+            }
+            if (dist[nx][ny] == -1 && is_empty(nx, ny, map))
+            {
+                dist[nx][ny] = dist[x][y] + 1;
+                queue[tail++] = nx * MAX_COLS + ny;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 协同多玩家寻路（窗口化分层协同 A*，WHCA*）
+//
+// 玩家按优先级依次在时空 (x, y, t) 上做 A*，已规划玩家的占用写入
+// 哈希时空预约表；后规划的玩家避开这些预约（包括相向交换位置）。
+// 启发值取自反向 BFS 得到的真实距离（抽象层忽略其他玩家）。
+// 每个窗口只执行前一半步数，然后以新位置重新规划。
+// ---------------------------------------------------------------------------
+
+#define RESERVATION_BITS 11
+#define RESERVATION_SLOTS (1 << RESERVATION_BITS)
+#define NO_AGENT 0xFF
+
+typedef struct
+{
+    uint32_t keys[RESERVATION_SLOTS]; // 0 表示空槽
+    unsigned char owners[RESERVATION_SLOTS];
+} ReservationTable;
+
+static uint32_t reservation_key(int x, int y, int t)
+{
+    return ((uint32_t)(t + 1) << 14) | ((uint32_t)x << 7) | (uint32_t)y;
+}
+
+static uint32_t reservation_slot(uint32_t key)
+{
+    return (key * 2654435761u) >> (32 - RESERVATION_BITS);
+}
+
+static void reservation_reserve(ReservationTable *table, int x, int y, int t, int agent)
+{
+    uint32_t key = reservation_key(x, y, t);
+    uint32_t i = reservation_slot(key);
+    while (table->keys[i] != 0 && table->keys[i] != key)
+    {
+        i = (i + 1) & (RESERVATION_SLOTS - 1);
+    }
+    table->keys[i] = key;
+    table->owners[i] = (unsigned char)agent;
+}
+
+static int reservation_owner(const ReservationTable *table, int x, int y, int t)
+{
+    uint32_t key = reservation_key(x, y, t);
+    uint32_t i = reservation_slot(key);
+    while (table->keys[i] != 0)
+    {
+        if (table->keys[i] == key)
+        {
+            return table->owners[i];
+        }
+        i = (i + 1) & (RESERVATION_SLOTS - 1);
+    }
+    return NO_AGENT;
+}
+
+// 时空状态编号：(t, x, y) -> 一维下标
+#define ST_INDEX(t, x, y) (((t) * MAX_ROWS + (x)) * MAX_COLS + (y))
+#define ST_STATES ((PLAN_WINDOW + 1) * MAX_ROWS * MAX_COLS)
+#define ST_HEAP_CAPACITY (1 << 19)
+
+typedef struct
+{
+    int f;
+    int g;
+    int state;
+} HeapNode;
+
+static bool heap_less(const HeapNode *a, const HeapNode *b)
+{
+    // f 相同时优先展开 g 更大的节点（更接近终点）
+    return a->f < b->f || (a->f == b->f && a->g > b->g);
+}
+
+static void heap_push(HeapNode *heap, int *size, HeapNode node)
+{
+    int i = (*size)++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (!heap_less(&node, &heap[parent]))
+        {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = node;
+}
+
+static HeapNode heap_pop(HeapNode *heap, int *size)
+{
+    HeapNode top = heap[0];
+    HeapNode last = heap[--(*size)];
+    int i = 0;
+    while (2 * i + 1 < *size)
+    {
+        int child = 2 * i + 1;
+        if (child + 1 < *size && heap_less(&heap[child + 1], &heap[child]))
+        {
+            child++;
+        }
+        if (!heap_less(&heap[child], &last))
+        {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+// 单个玩家在窗口内的时空 A*，成功时 path_x/path_y 给出 t = 0..PLAN_WINDOW 的位置
+static bool space_time_astar(const Map *map, const ReservationTable *table, int agent,
+                             int sx, int sy, int gx, int gy, int h[MAX_ROWS][MAX_COLS],
+                             int path_x[PLAN_WINDOW + 1], int path_y[PLAN_WINDOW + 1])
+{
+    // 用搜索编号做惰性初始化，避免每次清空整张时空表
+    static unsigned int stamp[ST_STATES];
+    static int g_cost[ST_STATES];
+    static int parent[ST_STATES];
+    static HeapNode heap[ST_HEAP_CAPACITY];
+    static unsigned int search_id = 0;
+    search_id++;
+
+    int heap_size = 0;
+    int start = ST_INDEX(0, sx, sy);
+    stamp[start] = search_id;
+    g_cost[start] = 0;
+    parent[start] = -1;
+    heap_push(heap, &heap_size, (HeapNode){h[sx][sy], 0, start});
+
+    int goal_state = -1;
+    while (heap_size > 0)
+    {
+        HeapNode node = heap_pop(heap, &heap_size);
+        int t = node.state / (MAX_ROWS * MAX_COLS);
+        int x = node.state / MAX_COLS % MAX_ROWS;
+        int y = node.state % MAX_COLS;
+        if (node.g > g_cost[node.state])
+        {
+            continue; // 过期的堆节点
+        }
+        if (t == PLAN_WINDOW)
+        {
+            goal_state = node.state;
+            break;
+        }
+        if (x == gx && y == gy)
+        {
+            // 到达终点后若能一直停留到窗口结束，则视为完成
+            bool can_stay = true;
+            for (int k = t + 1; k <= PLAN_WINDOW && can_stay; k++)
+            {
+                int owner = reservation_owner(table, x, y, k);
+                can_stay = owner == NO_AGENT || owner == agent;
+            }
+            if (can_stay)
+            {
+                goal_state = node.state;
+                break;
+            }
+        }
+        for (int d = 0; d <= DIR_WAIT; d++)
+        {
+            int nx = x, ny = y;
+            if (d != DIR_WAIT)
+            {
+                nx += DIR_DX[d];
+                ny += DIR_DY[d];
+                if (nx < 1 || nx > map->rows || ny < 1 || ny > map->cols || !is_empty(nx, ny, map))
+                {
+                    continue;
+                }
+            }
+            int owner = reservation_owner(table, nx, ny, t + 1);
+            if (owner != NO_AGENT && owner != agent)
+            {
+                continue; // 顶点冲突
+            }
+            int swap = reservation_owner(table, nx, ny, t);
+            if (d != DIR_WAIT && swap != NO_AGENT && swap != agent &&
+                reservation_owner(table, x, y, t + 1) == swap)
+            {
+                continue; // 边冲突：两名玩家相向交换位置
+            }
+            int next = ST_INDEX(t + 1, nx, ny);
+            // 停在终点不计代价，鼓励尽早到达并等待
+            int step = (d == DIR_WAIT && x == gx && y == gy) ? 0 : 1;
+            int ng = node.g + step;
+            if (stamp[next] == search_id && g_cost[next] <= ng)
+            {
+                continue;
+            }
+            if (heap_size >= ST_HEAP_CAPACITY)
+            {
+                return false;
+            }
+            stamp[next] = search_id;
+            g_cost[next] = ng;
+            parent[next] = node.state;
+            heap_push(heap, &heap_size, (HeapNode){ng + h[nx][ny], ng, next});
+        }
+    }
+    if (goal_state == -1)
+    {
+        return false;
+    }
+
+    // 回溯路径，终点之后的时刻保持原地
+    int end_t = goal_state / (MAX_ROWS * MAX_COLS);
+    for (int s = goal_state; s != -1; s = parent[s])
+    {
+        int t = s / (MAX_ROWS * MAX_COLS);
+        path_x[t] = s / MAX_COLS % MAX_ROWS;
+        path_y[t] = s % MAX_COLS;
+    }
+    for (int t = end_t + 1; t <= PLAN_WINDOW; t++)
+    {
+        path_x[t] = path_x[end_t];
+        path_y[t] = path_y[end_t];
+    }
+    return true;
+}
+
+// 为地图上所有玩家生成互不碰撞的移动序列；未指定目标的玩家以当前位置为目标
+ErrorCode plan_cooperative(const Map *map, const Goal *goals, int goal_count, Plan *plan)
+{
+    static int h[MAX_PLAYERS][MAX_ROWS][MAX_COLS];
+    static ReservationTable table;
+    int pos_x[MAX_PLAYERS], pos_y[MAX_PLAYERS];
+    int goal_x[MAX_PLAYERS], goal_y[MAX_PLAYERS];
+    int order[MAX_PLAYERS];
+    int agent_count = 0;
+
+    memset(plan, 0, sizeof(*plan));
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (is_player(i, j, map, -1))
+            {
+                int p = map->cells[i][j] - '0';
+                plan->active[p] = true;
+                pos_x[p] = goal_x[p] = i;
+                pos_y[p] = goal_y[p] = j;
+            }
+        }
+    }
+    for (int k = 0; k < goal_count; k++)
+    {
+        const Goal *goal = &goals[k];
+        if (!plan->active[goal->player] || goal->x < 1 || goal->x > map->rows ||
+            goal->y < 1 || goal->y > map->cols || !is_empty(goal->x, goal->y, map))
+        {
+            return ERR_INVALID_ARGS;
+        }
+        goal_x[goal->player] = goal->x;
+        goal_y[goal->player] = goal->y;
+    }
+    for (int p = 0; p < MAX_PLAYERS; p++)
+    {
+        if (!plan->active[p])
+        {
+            continue;
+        }
+        for (int q = 0; q < p; q++)
+        {
+            if (plan->active[q] && goal_x[q] == goal_x[p] && goal_y[q] == goal_y[p])
+            {
+                return ERR_INVALID_ARGS; // 两名玩家不能共享终点
+            }
+        }
+        bfs_distances(map, goal_x[p], goal_y[p], h[p]);
+        if (h[p][pos_x[p]][pos_y[p]] < 0)
+        {
+            return ERR_NO_PATH;
+        }
+        order[agent_count++] = p;
+    }
+
+    int path_x[PLAN_WINDOW + 1], path_y[PLAN_WINDOW + 1];
+    int next_x[MAX_PLAYERS][PLAN_WINDOW / 2 + 1], next_y[MAX_PLAYERS][PLAN_WINDOW / 2 + 1];
+    while (plan->ticks < PLAN_MAX_TICKS)
+    {
+        bool done = true;
+        for (int k = 0; k < agent_count; k++)
+        {
+            int p = order[k];
+            done = done && pos_x[p] == goal_x[p] && pos_y[p] == goal_y[p];
+        }
+        if (done)
+        {
+            break;
+        }
+
+        // 离终点越远优先级越高，已到达的玩家最后规划，便于让路
+        for (int a = 1; a < agent_count; a++)
+        {
+            int p = order[a], b = a;
+            while (b > 0 && h[order[b - 1]][pos_x[order[b - 1]]][pos_y[order[b - 1]]] < h[p][pos_x[p]][pos_y[p]])
+            {
+                order[b] = order[b - 1];
+                b--;
+            }
+            order[b] = p;
+        }
+
+        memset(table.keys, 0, sizeof(table.keys));
+        for (int k = 0; k < agent_count; k++)
+        {
+            reservation_reserve(&table, pos_x[order[k]], pos_y[order[k]], 0, order[k]);
+        }
+
+        int steps = PLAN_WINDOW / 2;
+        for (int k = 0; k < agent_count; k++)
+        {
+            int p = order[k];
+            if (!space_time_astar(map, &table, p, pos_x[p], pos_y[p], goal_x[p], goal_y[p], h[p], path_x, path_y))
+            {
+                return ERR_NO_PATH;
+            }
+            for (int t = 0; t <= PLAN_WINDOW; t++)
+            {
+                reservation_reserve(&table, path_x[t], path_y[t], t, p);
+            }
+            for (int t = 0; t <= steps; t++)
+            {
+                next_x[p][t] = path_x[t];
+                next_y[p][t] = path_y[t];
+            }
+        }
+
+        // 执行窗口的前半部分
+        if (plan->ticks + steps > PLAN_MAX_TICKS)
+        {
+            steps = PLAN_MAX_TICKS - plan->ticks;
+        }
+        for (int t = 0; t < steps; t++)
+        {
+            for (int k = 0; k < agent_count; k++)
+            {
+                int p = order[k];
+                int move = DIR_WAIT;
+                for (int d = 0; d < 4; d++)
+                {
+                    if (next_x[p][t + 1] == next_x[p][t] + DIR_DX[d] && next_y[p][t + 1] == next_y[p][t] + DIR_DY[d])
+                    {
+                        move = d;
+                    }
+                }
+                plan->moves[p][plan->ticks + t] = (signed char)move;
+            }
+        }
+        for (int k = 0; k < agent_count; k++)
+        {
+            int p = order[k];
+            pos_x[p] = next_x[p][steps];
+            pos_y[p] = next_y[p][steps];
+        }
+        plan->ticks += steps;
+    }
+
+    for (int k = 0; k < agent_count; k++)
+    {
+        int p = order[k];
+        if (pos_x[p] != goal_x[p] || pos_y[p] != goal_y[p])
+        {
+            return ERR_NO_PATH;
+        }
+        plan->final_x[p] = pos_x[p];
+        plan->final_y[p] = pos_y[p];
+    }
+
+    // 去掉所有玩家都在等待的尾部步数
+    while (plan->ticks > 0)
+    {
+        bool all_wait = true;
+        for (int p = 0; p < MAX_PLAYERS; p++)
+        {
+            all_wait = all_wait && (!plan->active[p] || plan->moves[p][plan->ticks - 1] == DIR_WAIT);
+        }
+        if (!all_wait)
+        {
+            break;
+        }
+        plan->ticks--;
+    }
+    return ERR_NONE;
+}
+
+// 每名玩家一行：玩家编号后跟逐步动作
+void print_plan(const Plan *plan)
+{
+    for (int p = 0; p < MAX_PLAYERS; p++)
+    {
+        if (!plan->active[p])
+        {
+            continue;
+        }
+        printf("%d:", p);
+        for (int t = 0; t < plan->ticks; t++)
+        {
+            printf(" %s", DIR_NAMES[plan->moves[p][t]]);
+        }
+        printf("\n");
+    }
+}
+
+// 将所有参与规划的玩家移到规划终点
+void apply_plan(Map *map, const Plan *plan)
+{
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (is_player(i, j, map, -1) && plan->active[map->cells[i][j] - '0'])
+            {
+                set_cell(map, i, j, '.');
+            }
+        }
+    }
+    for (int p = 0; p < MAX_PLAYERS; p++)
+    {
+        if (plan->active[p])
+        {
+            set_cell(map, plan->final_x[p], plan->final_y[p], p + '0');
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// D* Lite 增量寻路
+//
+// 从终点反向搜索，g/rhs 与优先队列在多次查询之间保留。玩家移动时只需
+// 更新起点并累加 km；格子可通行性变化时（通过 set_cell 观察者通知），
+// 只对该格及其邻居重新计算 rhs，下一次查询时修复受影响的部分。
+// 对被规划的玩家而言，其他玩家与墙一样不可通行。
+// ---------------------------------------------------------------------------
+
+#define DSTAR_INF 0x3fffffff
+
+static int dstar_h(int ax, int ay, int bx, int by)
+{
+    return abs(ax - bx) + abs(ay - by);
+}
+
+static bool dstar_passable(const DStarLite *ds, int x, int y)
+{
+    if (x < 1 || x > ds->map->rows || y < 1 || y > ds->map->cols)
+    {
+        return false;
+    }
+    char c = ds->map->cells[x][y];
+    return c == '.' || c == ds->player + '0';
+}
+
+static bool dstar_key_less(const DStarLite *ds, int a, int b)
+{
+    int ax = a / MAX_COLS, ay = a % MAX_COLS;
+    int bx = b / MAX_COLS, by = b % MAX_COLS;
+    return ds->key1[ax][ay] < ds->key1[bx][by] ||
+           (ds->key1[ax][ay] == ds->key1[bx][by] && ds->key2[ax][ay] < ds->key2[bx][by]);
+}
+
+static void dstar_heap_set(DStarLite *ds, int i, int cell)
+{
+    ds->heap[i] = cell;
+    ds->heap_pos[cell / MAX_COLS][cell % MAX_COLS] = i;
+}
+
+static void dstar_sift_up(DStarLite *ds, int i)
+{
+    int cell = ds->heap[i];
+    while (i > 0 && dstar_key_less(ds, cell, ds->heap[(i - 1) / 2]))
+    {
+        dstar_heap_set(ds, i, ds->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    dstar_heap_set(ds, i, cell);
+}
+
+static void dstar_sift_down(DStarLite *ds, int i)
+{
+    int cell = ds->heap[i];
+    while (2 * i + 1 < ds->heap_size)
+    {
+        int child = 2 * i + 1;
+        if (child + 1 < ds->heap_size && dstar_key_less(ds, ds->heap[child + 1], ds->heap[child]))
+        {
+            child++;
+        }
+        if (!dstar_key_less(ds, ds->heap[child], cell))
+        {
+            break;
+        }
+        dstar_heap_set(ds, i, ds->heap[child]);
+        i = child;
+    }
+    dstar_heap_set(ds, i, cell);
+}
+
+static void dstar_heap_remove(DStarLite *ds, int x, int y)
+{
+    int i = ds->heap_pos[x][y];
+    ds->heap_pos[x][y] = -1;
+    ds->heap_size--;
+    if (i == ds->heap_size)
+    {
+        return;
+    }
+    dstar_heap_set(ds, i, ds->heap[ds->heap_size]);
+    dstar_sift_up(ds, i);
+    dstar_sift_down(ds, ds->heap_pos[ds->heap[i] / MAX_COLS][ds->heap[i] % MAX_COLS]);
+}
+
+// 计算 (x, y) 的键值并插入或调整其在队列中的位置
+static void dstar_heap_update(DStarLite *ds, int x, int y)
+{
+    int m = ds->g[x][y] < ds->rhs[x][y] ? ds->g[x][y] : ds->rhs[x][y];
+    ds->key1[x][y] = m + dstar_h(ds->start_x, ds->start_y, x, y) + ds->km;
+    ds->key2[x][y] = m;
+    int i = ds->heap_pos[x][y];
+    if (i == -1)
+    {
+        i = ds->heap_size++;
+        dstar_heap_set(ds, i, x * MAX_COLS + y);
+    }
+    dstar_sift_up(ds, i);
+    dstar_sift_down(ds, ds->heap_pos[x][y]);
+}
+
+static void dstar_update_vertex(DStarLite *ds, int x, int y)
+{
+    if (x < 1 || x > ds->map->rows || y < 1 || y > ds->map->cols)
+    {
+        return;
+    }
+    if (x != ds->goal_x || y != ds->goal_y)
+    {
+        int best = DSTAR_INF;
+        if (dstar_passable(ds, x, y))
+        {
+            for (int d = 0; d < 4; d++)
+            {
+                int nx = x + DIR_DX[d], ny = y + DIR_DY[d];
+                if (dstar_passable(ds, nx, ny) && ds->g[nx][ny] + 1 < best)
+                {
+                    best = ds->g[nx][ny] + 1;
+                }
+            }
+        }
+        ds->rhs[x][y] = best;
+    }
+    if (ds->g[x][y] != ds->rhs[x][y])
+    {
+        dstar_heap_update(ds, x, y);
+    }
+    else if (ds->heap_pos[x][y] != -1)
+    {
+        dstar_heap_remove(ds, x, y);
+    }
+}
+
+void dstar_init(DStarLite *ds, const Map *map, int player, int sx, int sy, int gx, int gy)
+{
+    ds->map = map;
+    ds->player = player;
+    ds->start_x = ds->last_x = sx;
+    ds->start_y = ds->last_y = sy;
+    ds->goal_x = gx;
+    ds->goal_y = gy;
+    ds->km = 0;
+    ds->heap_size = 0;
+    for (int i = 0; i < MAX_ROWS; i++)
+    {
+        for (int j = 0; j < MAX_COLS; j++)
+        {
+            ds->g[i][j] = ds->rhs[i][j] = DSTAR_INF;
+            ds->heap_pos[i][j] = -1;
+        }
+    }
+    ds->rhs[gx][gy] = 0;
+    dstar_heap_update(ds, gx, gy);
+}
+
+// 玩家移动后更新起点；km 累加保证队列中旧键值仍是下界
+void dstar_set_start(DStarLite *ds, int sx, int sy)
+{
+    ds->start_x = sx;
+    ds->start_y = sy;
+}
+
+// set_cell 观察者：可通行性发生变化时修复该格及其邻居
+void dstar_cell_changed(void *ctx, const Map *map, int x, int y, char old_cell)
+{
+    DStarLite *ds = ctx;
+    bool was_passable = old_cell == '.' || old_cell == ds->player + '0';
+    if (map != ds->map || was_passable == dstar_passable(ds, x, y))
+    {
+        return;
+    }
+    ds->km += dstar_h(ds->last_x, ds->last_y, ds->start_x, ds->start_y);
+    ds->last_x = ds->start_x;
+    ds->last_y = ds->start_y;
+    dstar_update_vertex(ds, x, y);
+    for (int d = 0; d < 4; d++)
+    {
+        dstar_update_vertex(ds, x + DIR_DX[d], y + DIR_DY[d]);
+    }
+}
+
+static void dstar_compute_shortest_path(DStarLite *ds)
+{
+    int sx = ds->start_x, sy = ds->start_y;
+    for (;;)
+    {
+        int m = ds->g[sx][sy] < ds->rhs[sx][sy] ? ds->g[sx][sy] : ds->rhs[sx][sy];
+        int start_k1 = m + ds->km, start_k2 = m;
+        if (ds->heap_size == 0)
+        {
+            break;
+        }
+        int top = ds->heap[0];
+        int ux = top / MAX_COLS, uy = top % MAX_COLS;
+        bool top_less = ds->key1[ux][uy] < start_k1 ||
+                        (ds->key1[ux][uy] == start_k1 && ds->key2[ux][uy] < start_k2);
+        if (!top_less && ds->rhs[sx][sy] == ds->g[sx][sy])
+        {
+            break;
+        }
+
+        int old_k1 = ds->key1[ux][uy], old_k2 = ds->key2[ux][uy];
+        int nm = ds->g[ux][uy] < ds->rhs[ux][uy] ? ds->g[ux][uy] : ds->rhs[ux][uy];
+        int new_k1 = nm + dstar_h(sx, sy, ux, uy) + ds->km, new_k2 = nm;
+        if (old_k1 < new_k1 || (old_k1 == new_k1 && old_k2 < new_k2))
+        {
+            dstar_heap_update(ds, ux, uy); // 键值过期，重新排队
+        }
+        else if (ds->g[ux][uy] > ds->rhs[ux][uy])
+        {
+            ds->g[ux][uy] = ds->rhs[ux][uy];
+            dstar_heap_remove(ds, ux, uy);
+            for (int d = 0; d < 4; d++)
+            {
+                dstar_update_vertex(ds, ux + DIR_DX[d], uy + DIR_DY[d]);
+            }
+        }
+        else
+        {
+            ds->g[ux][uy] = DSTAR_INF;
+            dstar_update_vertex(ds, ux, uy);
+            for (int d = 0; d < 4; d++)
+            {
+                dstar_update_vertex(ds, ux + DIR_DX[d], uy + DIR_DY[d]);
+            }
+        }
+    }
+}
+
+// 给出从当前起点出发的下一步方向；已在终点时返回 DIR_WAIT
+ErrorCode dstar_next_step(DStarLite *ds, int *dir)
+{
+    int sx = ds->start_x, sy = ds->start_y;
+    if (sx == ds->goal_x && sy == ds->goal_y)
+    {
+        *dir = DIR_WAIT;
+        return ERR_NONE;
+    }
+    dstar_compute_shortest_path(ds);
+    if (ds->rhs[sx][sy] >= DSTAR_INF)
+    {
+        return ERR_NO_PATH;
+    }
+    int best = DSTAR_INF;
+    *dir = DIR_WAIT;
+    for (int d = 0; d < 4; d++)
+    {
+        int nx = sx + DIR_DX[d], ny = sy + DIR_DY[d];
+        if (dstar_passable(ds, nx, ny) && ds->g[nx][ny] + 1 < best)
+        {
+            best = ds->g[nx][ny] + 1;
+            *dir = d;
+        }
+    }
+    return best < DSTAR_INF ? ERR_NONE : ERR_NO_PATH;
+}
+
+// 使用 D* Lite 将玩家逐步移动到 (gx, gy)，每一步都经由 move_player。
+// blocks 在对应步数经由 set_cell 放墙，D* Lite 通过观察者只修复受影响的部分
+ErrorCode route_player(Map *map, int player, int gx, int gy, const RouteBlock *blocks, int block_count, Route *route)
+{
+    static DStarLite ds;
+    int sx = -1, sy = -1;
+    for (int i = 1; i <= map->rows && sx == -1; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (is_player(i, j, map, player))
+            {
+                sx = i;
+                sy = j;
+                break;
+            }
+        }
+    }
+    if (sx == -1 || gx < 1 || gx > map->rows || gy < 1 || gy > map->cols)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    for (int b = 0; b < block_count; b++)
+    {
+        if (blocks[b].x < 1 || blocks[b].x > map->rows || blocks[b].y < 1 || blocks[b].y > map->cols)
+        {
+            return ERR_INVALID_ARGS;
+        }
+    }
+
+    route->player = player;
+    route->steps = 0;
+    dstar_init(&ds, map, player, sx, sy, gx, gy);
+    add_cell_observer(dstar_cell_changed, &ds);
+    ErrorCode err = ERR_NONE;
+    int max_steps = 4 * map->rows * map->cols;
+    for (int step = 0; step < max_steps; step++)
+    {
+        for (int b = 0; b < block_count && err == ERR_NONE; b++)
+        {
+            if (blocks[b].step != step)
+            {
+                continue;
+            }
+            if (is_player(blocks[b].x, blocks[b].y, map, -1))
+            {
+                err = ERR_MOVE_FAILED;
+            }
+            else
+            {
+                set_cell(map, blocks[b].x, blocks[b].y, '#');
+            }
+        }
+        if (err != ERR_NONE)
+        {
+            break;
+        }
+        int dir;
+        err = dstar_next_step(&ds, &dir);
+        if (err != ERR_NONE || dir == DIR_WAIT)
+        {
+            break;
+        }
+        err = move_player(map, player, DIR_NAMES[dir]);
+        if (err != ERR_NONE)
+        {
+            break;
+        }
+        route->moves[route->steps++] = dir;
+        dstar_set_start(&ds, ds.start_x + DIR_DX[dir], ds.start_y + DIR_DY[dir]);
+    }
+    remove_cell_observer(dstar_cell_changed, &ds);
+    if (err == ERR_NONE && (ds.start_x != gx || ds.start_y != gy))
+    {
+        err = ERR_NO_PATH;
+    }
+    return err;
+}
+
+void print_route(const Route *route)
+{
+    printf("%d:", route->player);
+    for (int t = 0; t < route->steps; t++)
+    {
+        printf(" %s", DIR_NAMES[route->moves[t]]);
+    }
+    printf("\n");
+}
+
+// ---------------------------------------------------------------------------
+// 地形代价与带权寻路
+//
+// 进入一个格子的代价由其地形类别决定（见 TERRAIN_COST）。代价都是很小的
+// 整数，因此用 Dial 桶队列代替二叉堆：MAX_TERRAIN_COST + 1 个循环桶，
+// 入队、出队都是 O(1)，带权寻路的开销接近 BFS。
+// ---------------------------------------------------------------------------
+
+// 返回地形字符对应的类别，非地形字符返回 -1
+int terrain_class(char c)
+{
+    for (int t = 0; t < TERRAIN_CLASSES; t++)
+    {
+        if (TERRAIN_CHARS[t] == c)
+        {
+            return t;
+        }
+    }
+    return -1;
+}
+
+// 计算玩家到 (gx, gy) 的最小代价路径，dirs 中依次给出 length 个方向
+ErrorCode dijkstra_route(const Map *map, int player, int gx, int gy, int *cost, int *dirs, int *length)
+{
+    static int dist[MAX_ROWS][MAX_COLS];
+    static int from_dir[MAX_ROWS][MAX_COLS];
+    // 桶内链表节点：同一格在松弛后可能同时出现在多个桶中，因此每次入桶分配新节点
+    static int entry_cell[4 * MAX_ROWS * MAX_COLS + 1];
+    static int entry_next[4 * MAX_ROWS * MAX_COLS + 1];
+    int entry_count = 0;
+    int bucket_head[MAX_TERRAIN_COST + 1];
+    char playerChar = player + '0';
+
+    int sx = -1, sy = -1;
+    for (int i = 1; i <= map->rows && sx == -1; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (map->cells[i][j] == playerChar)
+            {
+                sx = i;
+                sy = j;
+                break;
+            }
+        }
+    }
+    if (sx == -1 || gx < 1 || gx > map->rows || gy < 1 || gy > map->cols)
+    {
+        return ERR_INVALID_ARGS;
+    }
+
+    for (int i = 0; i < MAX_ROWS; i++)
+    {
+        for (int j = 0; j < MAX_COLS; j++)
+        {
+            dist[i][j] = -1;
+        }
+    }
+    for (int b = 0; b <= MAX_TERRAIN_COST; b++)
+    {
+        bucket_head[b] = -1;
+    }
+
+    // 桶 d % (MAX_TERRAIN_COST + 1) 存放距离为 d 的格子，出桶时按 dist 丢弃过期项
+    int pending = 1;
+    dist[sx][sy] = 0;
+    from_dir[sx][sy] = -1;
+    entry_cell[0] = sx * MAX_COLS + sy;
+    entry_next[0] = -1;
+    entry_count = 1;
+    bucket_head[0] = 0;
+    for (int d = 0; pending > 0 && dist[gx][gy] != d; d++)
+    {
+        int b = d % (MAX_TERRAIN_COST + 1);
+        while (bucket_head[b] != -1)
+        {
+            int entry = bucket_head[b];
+            bucket_head[b] = entry_next[entry];
+            pending--;
+            int x = entry_cell[entry] / MAX_COLS, y = entry_cell[entry] % MAX_COLS;
+            if (dist[x][y] != d)
+            {
+                continue;
+            }
+            for (int k = 0; k < 4; k++)
+            {
+                int nx = x + DIR_DX[k], ny = y + DIR_DY[k];
+                if (nx < 1 || nx > map->rows || ny < 1 || ny > map->cols || map->cells[nx][ny] != '.')
+                {
+                    continue;
+                }
+                int nd = d + TERRAIN_COST[map->terrain[nx][ny]];
+                if (dist[nx][ny] != -1 && dist[nx][ny] <= nd)
+                {
+                    continue;
+                }
+                dist[nx][ny] = nd;
+                from_dir[nx][ny] = k;
+                int nb = nd % (MAX_TERRAIN_COST + 1);
+                entry_cell[entry_count] = nx * MAX_COLS + ny;
+                entry_next[entry_count] = bucket_head[nb];
+                bucket_head[nb] = entry_count++;
+                pending++;
+            }
+        }
+    }
+    if (dist[gx][gy] == -1 || (map->cells[gx][gy] != '.' && map->cells[gx][gy] != playerChar))
+    {
+        return ERR_NO_PATH;
+    }
+
+    *cost = dist[gx][gy];
+    *length = 0;
+    for (int x = gx, y = gy; from_dir[x][y] != -1;)
+    {
+        int k = from_dir[x][y];
+        dirs[(*length)++] = k;
+        x -= DIR_DX[k];
+        y -= DIR_DY[k];
+    }
+    for (int i = 0, j = *length - 1; i < j; i++, j--)
+    {
+        int tmp = dirs[i];
+        dirs[i] = dirs[j];
+        dirs[j] = tmp;
+    }
+    return ERR_NONE;
+}
+
+// ---------------------------------------------------------------------------
+// 位图膨胀求 k 步可达区域
+//
+// 每一步把当前区域向上下左右各平移一格后按位或，再与可通行位图按位与。
+// 整行一次处理 64 列，区域不再增长时提前结束。
+// ---------------------------------------------------------------------------
+
+// 可通行位图：只有 '.' 可以进入（其他玩家与墙一样阻挡移动）
+void build_free_bits(const Map *map, BitGrid *free_bits)
+{
+    memset(free_bits, 0, sizeof(*free_bits));
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (map->cells[i][j] == '.')
+            {
+                free_bits->bits[i][j / 64] |= (uint64_t)1 << (j % 64);
+            }
+        }
+    }
+}
+
+ErrorCode reachable_within(const Map *map, int player, int k, BitGrid *reach, int *count)
+{
+    static BitGrid free_bits, next;
+    build_free_bits(map, &free_bits);
+    memset(reach, 0, sizeof(*reach));
+
+    bool found = false;
+    for (int i = 1; i <= map->rows && !found; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (is_player(i, j, map, player))
+            {
+                reach->bits[i][j / 64] |= (uint64_t)1 << (j % 64);
+                found = true;
+                break;
+            }
+        }
+    }
+    if (!found)
+    {
+        return ERR_INVALID_ARGS;
+    }
+
+    // 第 0 行与第 rows + 1 行始终为空，作为上下边界
+    memset(&next, 0, sizeof(next));
+    for (int step = 0; step < k; step++)
+    {
+        bool grew = false;
+        for (int i = 1; i <= map->rows; i++)
+        {
+            uint64_t carry_left = 0; // 低位字向高位字左移时带出的位
+            for (int w = 0; w < BITSET_WORDS; w++)
+            {
+                uint64_t cur = reach->bits[i][w];
+                uint64_t carry_right = w + 1 < BITSET_WORDS ? reach->bits[i][w + 1] << 63 : 0;
+                uint64_t grown = cur | (cur << 1) | carry_left | (cur >> 1) | carry_right |
+                                 reach->bits[i - 1][w] | reach->bits[i + 1][w];
+                next.bits[i][w] = cur | (grown & free_bits.bits[i][w]);
+                grew = grew || next.bits[i][w] != cur;
+                carry_left = cur >> 63;
+            }
+        }
+        memcpy(reach->bits[1], next.bits[1], sizeof(reach->bits[0]) * map->rows);
+        if (!grew)
+        {
+            break;
+        }
+    }
+
+    *count = 0;
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int w = 0; w < BITSET_WORDS; w++)
+        {
+            *count += __builtin_popcountll(reach->bits[i][w]);
+        }
+    }
+    return ERR_NONE;
+}
+
+// ---------------------------------------------------------------------------
+// 割点索引
+//
+// 对空地构成的网格图做一次迭代式 Tarjan 深度优先搜索，求出所有割点。
+// 玩家移动不改变空地集合（玩家格也算空地），索引保持有效；只有格子在
+// 空地与非空地之间切换时才失效，并在下一次查询时重建。
+// ---------------------------------------------------------------------------
+
+void cut_index_build(CutIndex *index, const Map *map)
+{
+    static int disc[MAX_ROWS][MAX_COLS];
+    static int low[MAX_ROWS][MAX_COLS];
+    static int stack_cell[MAX_ROWS * MAX_COLS];
+    static int stack_dir[MAX_ROWS * MAX_COLS];
+
+    index->map = map;
+    index->valid = true;
+    memset(index->cut, 0, sizeof(index->cut));
+    memset(disc, 0, sizeof(disc));
+
+    int timer = 0;
+    for (int si = 1; si <= map->rows; si++)
+    {
+        for (int sj = 1; sj <= map->cols; sj++)
+        {
+            if (!is_empty(si, sj, map) || disc[si][sj] != 0)
+            {
+                continue;
+            }
+            int root_children = 0;
+            int top = 0;
+            disc[si][sj] = low[si][sj] = ++timer;
+            stack_cell[0] = si * MAX_COLS + sj;
+            stack_dir[0] = 0;
+            while (top >= 0)
+            {
+                int x = stack_cell[top] / MAX_COLS, y = stack_cell[top] % MAX_COLS;
+                if (stack_dir[top] < 4)
+                {
+                    int d = stack_dir[top]++;
+                    int nx = x + DIR_DX[d], ny = y + DIR_DY[d];
+                    if (nx < 1 || nx > map->rows || ny < 1 || ny > map->cols || !is_empty(nx, ny, map))
+                    {
+                        continue;
+                    }
+                    if (disc[nx][ny] == 0)
+                    {
+                        if (top == 0)
+                        {
+                            root_children++;
+                        }
+                        disc[nx][ny] = low[nx][ny] = ++timer;
+                        top++;
+                        stack_cell[top] = nx * MAX_COLS + ny;
+                        stack_dir[top] = 0;
+                    }
+                    else if (disc[nx][ny] < low[x][y])
+                    {
+                        low[x][y] = disc[nx][ny]; // 回边（包括指向父节点的边，不影响割点判定）
+                    }
+                    continue;
+                }
+
+                // (x, y) 的所有邻居已处理完，回溯到父节点
+                top--;
+                if (top >= 0)
+                {
+                    int px = stack_cell[top] / MAX_COLS, py = stack_cell[top] % MAX_COLS;
+                    if (low[x][y] < low[px][py])
+                    {
+                        low[px][py] = low[x][y];
+                    }
+                    if (top > 0 && low[x][y] >= disc[px][py])
+                    {
+                        index->cut[px][py] = true;
+                    }
+                }
+            }
+            index->cut[si][sj] = root_children > 1;
+        }
+    }
+}
+
+// set_cell 观察者：只有空地集合变化时索引才失效
+void cut_index_cell_changed(void *ctx, const Map *map, int x, int y, char old_cell)
+{
+    CutIndex *index = ctx;
+    bool was_empty = old_cell == '.' || (old_cell >= '1' && old_cell <= '9');
+    if (map == index->map && was_empty != is_empty(x, y, map))
+    {
+        index->valid = false;
+    }
+}
+
+// 把 (x, y) 改为墙是否会使空区域不再连通
+bool would_split(CutIndex *index, int x, int y)
+{
+    if (!index->valid)
+    {
+        cut_index_build(index, index->map);
+    }
+    return index->cut[x][y];
+}
+
+// ---------------------------------------------------------------------------
+// 地图编辑与动态连通性
+//
+// 每条编辑都经由 set_cell 写入，Connectivity 作为观察者维护空区域个数：
+// 格子打开时在并查集中与相邻空地合并；格子关闭时在其周围做有界 BFS，
+// 确认原来相连的邻居仍然相连，只有确认失败时才整体重建。
+// ---------------------------------------------------------------------------
+
+#define LOCAL_CHECK_BUDGET 512 // 关闭格子时局部检查最多访问的格子数
+
+// 解析 "R,C=X" 形式的编辑，X 为 '#'、'.' 或地形字符
+ErrorCode parse_edit(const char *str, Edit *edit)
+{
+    char extra;
+    if (sscanf(str, "%d,%d=%c%c", &edit->x, &edit->y, &edit->c, &extra) != 3)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    if (edit->c != '#' && terrain_class(edit->c) < 0)
+    {
+        return ERR_INVALID_ARGS;
+    }
+    return ERR_NONE;
+}
+
+// 玩家所在的格子不能编辑：覆盖会让玩家从地图上消失
+ErrorCode edit_cell(Map *map, const Edit *edit)
+{
+    if (edit->x < 1 || edit->x > map->rows || edit->y < 1 || edit->y > map->cols)
+    {
+        return ERR_EDIT_FAILED;
+    }
+    char cell = map->cells[edit->x][edit->y];
+    if (cell >= '0' && cell <= '9')
+    {
+        return ERR_EDIT_FAILED;
+    }
+    int terrain = terrain_class(edit->c);
+    map->terrain[edit->x][edit->y] = terrain > 0 ? terrain : TERRAIN_PLAIN;
+    set_cell(map, edit->x, edit->y, edit->c == '#' ? '#' : '.');
+    return ERR_NONE;
+}
+
+// 批量编辑文件：每行一条 "R,C=X"，空行跳过
+ErrorCode apply_edit_file(Map *map, const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+    {
+        return ERR_EDIT_FAILED;
+    }
+    char buffer[64];
+    ErrorCode err = ERR_NONE;
+    while (err == ERR_NONE && fgets(buffer, sizeof(buffer), fp) != NULL)
+    {
+        trim_newline(buffer);
+        if (buffer[0] == '\0')
+        {
+            continue;
+        }
+        Edit edit;
+        err = parse_edit(buffer, &edit) == ERR_NONE ? edit_cell(map, &edit) : ERR_EDIT_FAILED;
+    }
+    fclose(fp);
+    return err;
+}
+
+static int uf_find(int *parent, int i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static bool uf_union(int *parent, int a, int b)
+{
+    a = uf_find(parent, a);
+    b = uf_find(parent, b);
+    if (a == b)
+    {
+        return false;
+    }
+    parent[a] = b;
+    return true;
+}
+
+// 为格子分配新的并查集节点：关闭过的格子可能仍是旧集合的内部节点，重新打开时不能复用
+static int connectivity_new_node(Connectivity *conn, int cell)
+{
+    int id = conn->node_count++;
+    conn->parent[id] = id;
+    conn->node[cell] = id;
+    return id;
+}
+
+void connectivity_build(Connectivity *conn, const Map *map)
+{
+    conn->map = map;
+    conn->components = 0;
+    conn->node_count = 0;
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            int cell = i * MAX_COLS + j;
+            int id = connectivity_new_node(conn, cell);
+            if (!is_empty(i, j, map))
+            {
+                continue;
+            }
+            conn->components++;
+            if (i > 1 && is_empty(i - 1, j, map) && uf_union(conn->parent, id, conn->node[cell - MAX_COLS]))
+            {
+                conn->components--;
+            }
+            if (j > 1 && is_empty(i, j - 1, map) && uf_union(conn->parent, id, conn->node[cell - 1]))
+            {
+                conn->components--;
+            }
+        }
+    }
+}
+
+// 在不经过 (x, y) 的前提下，从 from 出发的有界 BFS 能否找到 targets 中的所有格子
+static bool local_reconnects(const Map *map, int x, int y, int from, const int *targets, int target_count)
+{
+    static unsigned int seen[MAX_ROWS * MAX_COLS];
+    static unsigned int stamp = 0;
+    int queue[LOCAL_CHECK_BUDGET];
+    stamp++;
+
+    int head = 0, tail = 0, found = 0;
+    seen[x * MAX_COLS + y] = stamp;
+    seen[from] = stamp;
+    queue[tail++] = from;
+    while (head < tail)
+    {
+        int cell = queue[head++];
+        for (int k = 0; k < target_count; k++)
+        {
+            found += targets[k] == cell;
+        }
+        if (found == target_count)
+        {
+            return true;
+        }
+        int cx = cell / MAX_COLS, cy = cell % MAX_COLS;
+        for (int d = 0; d < 4; d++)
+        {
+            int nx = cx + DIR_DX[d], ny = cy + DIR_DY[d];
+            int next = nx * MAX_COLS + ny;
+            if (nx < 1 || nx > map->rows || ny < 1 || ny > map->cols || seen[next] == stamp || !is_empty(nx, ny, map))
+            {
+                continue;
+            }
+            if (tail == LOCAL_CHECK_BUDGET)
+            {
+                return false; // 超出预算，交给整体重建
+            }
+            seen[next] = stamp;
+            queue[tail++] = next;
+        }
+    }
+    return false;
+}
+
+// set_cell 观察者：维护空区域个数
+void connectivity_cell_changed(void *ctx, const Map *map, int x, int y, char old_cell)
+{
+    Connectivity *conn = ctx;
+    bool was_empty = old_cell == '.' || (old_cell >= '1' && old_cell <= '9');
+    bool now_empty = is_empty(x, y, map);
+    if (map != conn->map || was_empty == now_empty)
+    {
+        return;
+    }
+
+    int cell = x * MAX_COLS + y;
+    int neighbours[4], count = 0;
+    for (int d = 0; d < 4; d++)
+    {
+        int nx = x + DIR_DX[d], ny = y + DIR_DY[d];
+        if (nx >= 1 && nx <= map->rows && ny >= 1 && ny <= map->cols && is_empty(nx, ny, map))
+        {
+            neighbours[count++] = nx * MAX_COLS + ny;
+        }
+    }
+
+    if (now_empty)
+    {
+        if (conn->node_count == UF_POOL_SIZE)
+        {
+            connectivity_build(conn, map); // 节点池用尽，整体重建以回收
+            return;
+        }
+        // 打开：新建一个集合，再与相邻空地合并
+        int id = connectivity_new_node(conn, cell);
+        conn->components++;
+        for (int k = 0; k < count; k++)
+        {
+            if (uf_union(conn->parent, id, conn->node[neighbours[k]]))
+            {
+                conn->components--;
+            }
+        }
+        return;
+    }
+
+    // 关闭：孤立格直接消失；否则检查同一集合内的邻居是否仍然相连
+    if (count == 0)
+    {
+        conn->components--;
+        return;
+    }
+    int targets[4], target_count = 0;
+    int root = uf_find(conn->parent, conn->node[neighbours[0]]);
+    for (int k = 1; k < count; k++)
+    {
+        if (uf_find(conn->parent, conn->node[neighbours[k]]) == root)
+        {
+            targets[target_count++] = neighbours[k];
+        }
+    }
+    // 邻居分属多个集合（只在批量编辑的中间状态出现）时直接重建
+    bool others_in_other_sets = target_count + 1 < count;
+    if (!others_in_other_sets && (target_count == 0 || local_reconnects(map, x, y, neighbours[0], targets, target_count)))
+    {
+        return;
+    }
+    connectivity_build(conn, map);
+}
+
+// ---------------------------------------------------------------------------
+// 空区域标记与报告
+// ---------------------------------------------------------------------------
+
+// 一次线性扫描标记所有空区域，labels 中非空地为 0，返回区域个数
+int label_components(const Map *map, int labels[MAX_ROWS][MAX_COLS], ComponentInfo *infos)
+{
+    static int queue[MAX_ROWS * MAX_COLS];
+    int count = 0;
+    memset(labels, 0, sizeof(int) * MAX_ROWS * MAX_COLS);
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (!is_empty(i, j, map) || labels[i][j] != 0)
+            {
+                continue;
+            }
+            int id = ++count;
+            ComponentInfo *info = &infos[id];
+            *info = (ComponentInfo){0, i, i, j, j, i, j};
+            int head = 0, tail = 0;
+            labels[i][j] = id;
+            queue[tail++] = i * MAX_COLS + j;
+            while (head < tail)
+            {
+                int x = queue[head] / MAX_COLS, y = queue[head] % MAX_COLS;
+                head++;
+                info->size++;
+                info->min_x = x < info->min_x ? x : info->min_x;
+                info->max_x = x > info->max_x ? x : info->max_x;
+                info->min_y = y < info->min_y ? y : info->min_y;
+                info->max_y = y > info->max_y ? y : info->max_y;
+                for (int d = 0; d < 4; d++)
+                {
+                    int nx = x + DIR_DX[d], ny = y + DIR_DY[d];
+                    if (nx < 1 || nx > map->rows || ny < 1 || ny > map->cols)
+                    {
+                        continue;
+                    }
+                    if (labels[nx][ny] == 0 && is_empty(nx, ny, map))
+                    {
+                        labels[nx][ny] = id;
+                        queue[tail++] = nx * MAX_COLS + ny;
+                    }
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// 输出每个区域的编号、大小、外接矩形和代表格；dump_labels 时再输出标记图
+void print_components(const Map *map, bool dump_labels)
+{
+    static const char LABEL_CHARS[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    static int labels[MAX_ROWS][MAX_COLS];
+    static ComponentInfo infos[MAX_COMPONENTS + 1];
+    int count = label_components(map, labels, infos);
+
+    printf("components %d\n", count);
+    for (int id = 1; id <= count; id++)
+    {
+        const ComponentInfo *info = &infos[id];
+        printf("%d: size %d, rows %d-%d, cols %d-%d, cell %d,%d\n", id, info->size,
+               info->min_x, info->max_x, info->min_y, info->max_y, info->rep_x, info->rep_y);
+    }
+    if (!dump_labels)
+    {
+        return;
+    }
+    // 标记图：空地显示区域编号（超过 61 个区域时显示 '?'），其余格子原样输出
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            int id = labels[i][j];
+            if (id == 0)
+            {
+                printf("%c", map->cells[i][j]);
+            }
+            else
+            {
+                printf("%c", id < (int)sizeof(LABEL_CHARS) - 1 ? LABEL_CHARS[id] : '?');
+            }
+        }
+        printf("\n");
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 自动修复多个空区域
+//
+// 从所有空区域同时出发，在墙格上做多源 BFS：每个墙格记录最先到达它的
+// 区域和需要拆除的墙数。两个不同区域的势力范围相邻处给出一条候选连接，
+// 代价为两侧拆墙数之和。对候选连接按代价做 Kruskal，得到近似最小的
+// 连接方案，再沿 BFS 父指针拆除选中连接上的墙。'0' 格既不可通行也不拆除。
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+    int cost;
+    int a, b; // 相邻的两个格子
+} RepairEdge;
+
+static int repair_edge_cmp(const void *lhs, const void *rhs)
+{
+    const RepairEdge *a = lhs, *b = rhs;
+    return a->cost - b->cost;
+}
+
+// 沿父指针把 cell 到其所属空区域之间的墙全部拆除，返回拆除数量
+static int repair_open_path(Map *map, const int *from, int cell)
+{
+    int removed = 0;
+    for (; cell != -1; cell = from[cell])
+    {
+        int x = cell / MAX_COLS, y = cell % MAX_COLS;
+        if (map->cells[x][y] == '#')
+        {
+            set_cell(map, x, y, '.');
+            removed++;
+        }
+    }
+    return removed;
+}
+
+ErrorCode repair_map(Map *map, int *removed)
+{
+    static int labels[MAX_ROWS][MAX_COLS];
+    static ComponentInfo infos[MAX_COMPONENTS + 1];
+    static int owner[MAX_ROWS * MAX_COLS];
+    static int dist[MAX_ROWS * MAX_COLS];
+    static int from[MAX_ROWS * MAX_COLS];
+    static int queue[MAX_ROWS * MAX_COLS];
+    static RepairEdge edges[2 * MAX_ROWS * MAX_COLS];
+    static int parent[MAX_COMPONENTS + 1];
+
+    *removed = 0;
+    int count = label_components(map, labels, infos);
+    if (count <= 1)
+    {
+        return ERR_NONE;
+    }
+
+    // 所有空地作为源点同时入队，距离为 0
+    int head = 0, tail = 0;
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            int cell = i * MAX_COLS + j;
+            owner[cell] = labels[i][j];
+            dist[cell] = 0;
+            from[cell] = -1;
+            if (labels[i][j] != 0)
+            {
+                queue[tail++] = cell;
+            }
+        }
+    }
+    while (head < tail)
+    {
+        int cell = queue[head++];
+        int x = cell / MAX_COLS, y = cell % MAX_COLS;
+        for (int d = 0; d < 4; d++)
+        {
+            int nx = x + DIR_DX[d], ny = y + DIR_DY[d];
+            int next = nx * MAX_COLS + ny;
+            if (nx < 1 || nx > map->rows || ny < 1 || ny > map->cols ||
+                owner[next] != 0 || map->cells[nx][ny] != '#')
+            {
+                continue;
+            }
+            owner[next] = owner[cell];
+            dist[next] = dist[cell] + 1;
+            from[next] = cell;
+            queue[tail++] = next;
+        }
+    }
+
+    // 收集不同区域势力范围之间的相邻格对（只看右、下两个方向避免重复）
+    int edge_count = 0;
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            int cell = i * MAX_COLS + j;
+            int neighbours[2] = {i < map->rows ? cell + MAX_COLS : -1, j < map->cols ? cell + 1 : -1};
+            for (int k = 0; k < 2; k++)
+            {
+                int next = neighbours[k];
+                if (next == -1 || owner[cell] == 0 || owner[next] == 0 || owner[cell] == owner[next])
+                {
+                    continue;
+                }
+                edges[edge_count++] = (RepairEdge){dist[cell] + dist[next], cell, next};
+            }
+        }
+    }
+    qsort(edges, edge_count, sizeof(RepairEdge), repair_edge_cmp);
+
+    for (int id = 1; id <= count; id++)
+    {
+        parent[id] = id;
+    }
+    int joined = 1;
+    for (int k = 0; k < edge_count && joined < count; k++)
+    {
+        if (uf_union(parent, owner[edges[k].a], owner[edges[k].b]))
+        {
+            *removed += repair_open_path(map, from, edges[k].a);
+            *removed += repair_open_path(map, from, edges[k].b);
+            joined++;
+        }
+    }
+    return joined == count ? ERR_NONE : ERR_MULTIPLE_EMPTY_AREAS;
+}
+
+// ---------------------------------------------------------------------------
+// 直径与离心率（iFUB）
+//
+// 先用四次扫描找到一个靠近中心的格子 u，从 u 做 BFS 得到各层。直径下界
+// lb 取已算出的最大离心率，上界为 2 * ecc(u)；从最外层向内逐层计算该层
+// 格子的离心率，一旦 lb > 2 * (i - 1) 即可停止。通常只需少量 BFS。
+// ---------------------------------------------------------------------------
+
+// 返回 dist 中的最大距离，far_x/far_y 给出一个取到最大距离的格子
+static int bfs_farthest(const Map *map, int dist[MAX_ROWS][MAX_COLS], int *far_x, int *far_y)
+{
+    int best = 0;
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (dist[i][j] > best)
+            {
+                best = dist[i][j];
+                *far_x = i;
+                *far_y = j;
+            }
+        }
+    }
+    return best;
+}
+
+int eccentricity(const Map *map, int x, int y)
+{
+    static int dist[MAX_ROWS][MAX_COLS];
+    int fx = x, fy = y;
+    bfs_distances(map, x, y, dist);
+    return bfs_farthest(map, dist, &fx, &fy);
+}
+
+int area_diameter(const Map *map, int *bfs_runs)
+{
+    static int dist_a[MAX_ROWS][MAX_COLS];
+    static int dist_b[MAX_ROWS][MAX_COLS];
+    static int dist_u[MAX_ROWS][MAX_COLS];
+    static int level_cells[MAX_ROWS * MAX_COLS];
+    static int level_start[MAX_ROWS * MAX_COLS + 2];
+
+    *bfs_runs = 0;
+    int rx = -1, ry = -1;
+    for (int i = 1; i <= map->rows && rx == -1; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (is_empty(i, j, map))
+            {
+                rx = i;
+                ry = j;
+                break;
+            }
+        }
+    }
+    if (rx == -1)
+    {
+        return 0;
+    }
+
+    // 四次扫描：r -> a1 -> b1，取 a1-b1 路径中点，再重复一次
+    int ux = rx, uy = ry, lb = 0;
+    for (int sweep = 0; sweep < 2; sweep++)
+    {
+        int ax = ux, ay = uy, bx = ux, by = uy;
+        bfs_distances(map, ux, uy, dist_a);
+        bfs_farthest(map, dist_a, &ax, &ay);
+        bfs_distances(map, ax, ay, dist_a);
+        int d = bfs_farthest(map, dist_a, &bx, &by);
+        bfs_distances(map, bx, by, dist_b);
+        *bfs_runs += 3;
+        lb = d > lb ? d : lb;
+        for (int i = 1; i <= map->rows; i++)
+        {
+            for (int j = 1; j <= map->cols; j++)
+            {
+                if (dist_a[i][j] == d / 2 && dist_b[i][j] == d - d / 2)
+                {
+                    ux = i;
+                    uy = j;
+                }
+            }
+        }
+    }
+
+    // 从 u 出发按层分桶
+    bfs_distances(map, ux, uy, dist_u);
+    (*bfs_runs)++;
+    int fx = ux, fy = uy;
+    int ecc_u = bfs_farthest(map, dist_u, &fx, &fy);
+    lb = ecc_u > lb ? ecc_u : lb;
+    memset(level_start, 0, sizeof(int) * (ecc_u + 2));
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (dist_u[i][j] >= 0)
+            {
+                level_start[dist_u[i][j] + 1]++;
+            }
+        }
+    }
+    for (int level = 1; level <= ecc_u + 1; level++)
+    {
+        level_start[level] += level_start[level - 1];
+    }
+    for (int i = 1; i <= map->rows; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (dist_u[i][j] >= 0)
+            {
+                level_cells[level_start[dist_u[i][j]]++] = i * MAX_COLS + j;
+            }
+        }
+    }
+    // 上一步把 level_start 推进到了各层末尾，往回移一层恢复起点
+    for (int level = ecc_u + 1; level > 0; level--)
+    {
+        level_start[level] = level_start[level - 1];
+    }
+    level_start[0] = 0;
+
+    int ub = 2 * ecc_u;
+    for (int level = ecc_u; level > 0 && lb < ub; level--)
+    {
+        for (int k = level_start[level]; k < level_start[level + 1]; k++)
+        {
+            int e = eccentricity(map, level_cells[k] / MAX_COLS, level_cells[k] % MAX_COLS);
+            (*bfs_runs)++;
+            lb = e > lb ? e : lb;
+        }
+        if (lb > 2 * (level - 1))
+        {
+            break;
+        }
+        ub = 2 * (level - 1);
+    }
+    return lb;
+}
+
+// ---------------------------------------------------------------------------
+// 流式迷宫生成（Eller 算法）
+//
+// 迷宫格位于偶数行、偶数列（0 起始），其余位置是墙或通道。每次只处理一行
+// 迷宫格：先随机横向合并不同集合的相邻格，再保证每个集合至少向下打通一格，
+// 然后输出这一行和下方的墙行。内存只与列数有关，行数可以任意大。
+// 生成的地图总是只有一个空区域，可以直接被 load_map 读取。
+// ---------------------------------------------------------------------------
+
+// splitmix64：结果只由种子决定，便于复现
+uint64_t rng_next(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static bool rng_percent(uint64_t *state, int percent)
+{
+    return (int)(rng_next(state) % 100) < percent;
+}
+
+ErrorCode generate_maze(FILE *out, const GenerateOptions *gen)
+{
+    long width = (gen->cols + 1) / 2;  // 每行迷宫格数
+    long height = (gen->rows + 1) / 2; // 迷宫格行数
+    if (gen->players > width * height)
+    {
+        return ERR_INVALID_ARGS;
+    }
+
+    int *parent = malloc(sizeof(int) * width);
+    int *roots = malloc(sizeof(int) * width);
+    int *leader = malloc(sizeof(int) * width);
+    int *last_in_set = malloc(sizeof(int) * width);
+    bool *right = malloc(sizeof(bool) * width);
+    bool *down = malloc(sizeof(bool) * width);
+    bool *has_down = malloc(sizeof(bool) * width);
+    char *line = malloc(gen->cols + 2);
+    if (!parent || !roots || !leader || !last_in_set || !right || !down || !has_down || !line)
+    {
+        free(parent), free(roots), free(leader), free(last_in_set);
+        free(right), free(down), free(has_down), free(line);
+        return ERR_INVALID_ARGS;
+    }
+
+    // 玩家位置单独用一个随机流预先选好，保证互不重合
+    uint64_t rng = gen->seed;
+    long player_row[MAX_PLAYERS], player_col[MAX_PLAYERS];
+    for (int p = 1; p <= gen->players; p++)
+    {
+        bool clash;
+        do
+        {
+            player_row[p] = (long)(rng_next(&rng) % (uint64_t)height);
+            player_col[p] = (long)(rng_next(&rng) % (uint64_t)width);
+            clash = false;
+            for (int q = 1; q < p; q++)
+            {
+                clash = clash || (player_row[q] == player_row[p] && player_col[q] == player_col[p]);
+            }
+        } while (clash);
+    }
+
+    for (long k = 0; k < width; k++)
+    {
+        parent[k] = (int)k;
+    }
+    line[gen->cols] = '\n';
+    line[gen->cols + 1] = '\0';
+    for (long r = 0; r < height; r++)
+    {
+        bool last_row = r == height - 1;
+
+        // 横向：不同集合的相邻格随机合并；最后一行必须全部合并
+        for (long k = 0; k + 1 < width; k++)
+        {
+            int a = uf_find(parent, (int)k), b = uf_find(parent, (int)k + 1);
+            if (a != b && (last_row || rng_next(&rng) & 1))
+            {
+                parent[a] = b;
+                right[k] = true;
+            }
+            else
+            {
+                right[k] = a == b && rng_percent(&rng, gen->density);
+            }
+        }
+        right[width - 1] = false;
+        for (long c = 0; c < gen->cols; c++)
+        {
+            line[c] = c % 2 == 0 ? '.' : (right[c / 2] ? '.' : '#');
+        }
+        for (int p = 1; p <= gen->players; p++)
+        {
+            if (player_row[p] == r)
+            {
+                line[2 * player_col[p]] = p + '0';
+            }
+        }
+        fputs(line, out);
+        if (last_row)
+        {
+            break;
+        }
+
+        // 纵向：每个集合至少向下打通一格
+        for (long k = 0; k < width; k++)
+        {
+            roots[k] = uf_find(parent, (int)k);
+            has_down[roots[k]] = false;
+        }
+        for (long k = 0; k < width; k++)
+        {
+            down[k] = rng_next(&rng) & 1;
+            has_down[roots[k]] = has_down[roots[k]] || down[k];
+            last_in_set[roots[k]] = (int)k;
+        }
+        for (long k = 0; k < width; k++)
+        {
+            if (!has_down[roots[k]])
+            {
+                down[last_in_set[roots[k]]] = true;
+                has_down[roots[k]] = true;
+            }
+            down[k] = down[k] || rng_percent(&rng, gen->density);
+        }
+        // 墙行：偶数列是向下的通道；奇数列是墙柱，只在与已打通格相邻时才按密度打通
+        for (long c = 0; c < gen->cols; c++)
+        {
+            long k = c / 2;
+            if (c % 2 == 0)
+            {
+                line[c] = down[k] ? '.' : '#';
+            }
+            else
+            {
+                bool touches_open = down[k] || (k + 1 < width && down[k + 1]) || right[k];
+                line[c] = touches_open && rng_percent(&rng, gen->density) ? '.' : '#';
+            }
+        }
+        fputs(line, out);
+
+        // 下一行：向下打通的格子继承原集合，其余格子各自成为新集合
+        for (long k = 0; k < width; k++)
+        {
+            leader[roots[k]] = -1;
+        }
+        for (long k = 0; k < width; k++)
+        {
+            if (!down[k])
+            {
+                parent[k] = (int)k;
+            }
+            else if (leader[roots[k]] == -1)
+            {
+                leader[roots[k]] = (int)k;
+                parent[k] = (int)k;
+            }
+            else
+            {
+                parent[k] = leader[roots[k]];
+            }
+        }
+    }
+    // 行数为偶数时补一行墙
+    if (gen->rows % 2 == 0)
+    {
+        memset(line, '#', gen->cols);
+        fputs(line, out);
+    }
+
+    free(parent), free(roots), free(leader), free(last_in_set);
+    free(right), free(down), free(has_down), free(line);
+    return ferror(out) ? ERR_INVALID_ARGS : ERR_NONE;
+}
+
+// ---------------------------------------------------------------------------
+// 流式验证
+//
+// 逐字节处理地图文本，只保存上一行与当前行每格的区域标签（-1 表示墙）。
+// 当前行的空格子继承左侧或上方的标签，二者不同时在并查集中合并；行结束后
+// 上一行中没有延续到当前行的区域即已封闭，不会再与其他区域相连。
+// 封闭区域与仍开放的区域合计超过一个即可提前判定失败。每行结束时把标签
+// 压缩为 0..k-1 并重置并查集，因此内存只与列数有关，行数不限。
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+    long cap;    // 标签数组容量（列数上限，第一行读入时按需扩大）
+    int *prev;   // 上一行的标签
+    int *cur;    // 当前行的标签
+    int *parent; // 并查集，容量 2 * cap + 2：上一行标签加上本行新建的标签
+    int *remap;  // 压缩标签时根到新标签的映射
+    int labels;  // 当前已分配的标签数
+    long width;  // 列数，第一行结束前为 -1
+    long row, col;
+    int pending_cr; // 行内已读到、尚不能确定是否位于行尾的 '\r'
+    int closed;     // 已封闭的区域数
+    int open;       // 上一行中开放的区域数
+} StreamLabels;
+
+static bool stream_labels_reserve(StreamLabels *sl, long width)
+{
+    if (width < sl->cap)
+    {
+        return true;
+    }
+    long cap = sl->cap * 2 > width + 1 ? sl->cap * 2 : width + 1;
+    int *prev = realloc(sl->prev, sizeof(int) * cap);
+    if (prev != NULL)
+    {
+        sl->prev = prev;
+    }
+    int *cur = realloc(sl->cur, sizeof(int) * cap);
+    if (cur != NULL)
+    {
+        sl->cur = cur;
+    }
+    int *parent = realloc(sl->parent, sizeof(int) * (2 * cap + 2));
+    if (parent != NULL)
+    {
+        sl->parent = parent;
+    }
+    int *remap = realloc(sl->remap, sizeof(int) * (2 * cap + 2));
+    if (remap != NULL)
+    {
+        sl->remap = remap;
+    }
+    if (!prev || !cur || !parent || !remap)
+    {
+        return false;
+    }
+    sl->cap = cap;
+    return true;
+}
+
+// 一行结束：统计封闭的区域并把当前行标签压缩为 0..k-1，返回本行开放的区域数
+static int stream_end_row(StreamLabels *sl, long width, long prev_width, int *closed)
+{
+    for (int l = 0; l < sl->labels; l++)
+    {
+        sl->remap[l] = -1;
+    }
+    int open = 0;
+    for (long j = 0; j < width; j++)
+    {
+        if (sl->cur[j] >= 0)
+        {
+            int root = uf_find(sl->parent, sl->cur[j]);
+            if (sl->remap[root] < 0)
+            {
+                sl->remap[root] = open++;
+            }
+            sl->cur[j] = sl->remap[root];
+        }
+    }
+    // 上一行的区域若其根没有出现在本行，则已封闭
+    for (long j = 0; j < prev_width; j++)
+    {
+        if (sl->prev[j] >= 0)
+        {
+            int root = uf_find(sl->parent, sl->prev[j]);
+            if (sl->remap[root] == -1)
+            {
+                sl->remap[root] = -2; // 只计一次
+                (*closed)++;
+            }
+        }
+    }
+    int *tmp = sl->prev;
+    sl->prev = sl->cur;
+    sl->cur = tmp;
+    for (int l = 0; l < open; l++)
+    {
+        sl->parent[l] = l;
+    }
+    sl->labels = open;
+    return open;
+}
+
+// 处理一块解码后的文本；状态保存在 sl 中，块边界可以落在行内任意位置
+static ErrorCode stream_validate_feed(void *ctx, const char *data, size_t len)
+{
+    StreamLabels *sl = ctx;
+    for (size_t k = 0; k < len; k++)
+    {
+        char c = data[k];
+        if (c == '\n')
+        {
+            sl->pending_cr = 0;
+            if (sl->col == 0)
+            {
+                continue; // 跳过空行
+            }
+            if (sl->width < 0)
+            {
+                sl->width = sl->col;
+            }
+            else if (sl->col != sl->width)
+            {
+                return ERR_INVALID_MAP;
+            }
+            sl->open = stream_end_row(sl, sl->width, sl->row > 0 ? sl->width : 0, &sl->closed);
+            sl->row++;
+            sl->col = 0;
+            if (sl->closed > 1 || (sl->closed == 1 && sl->open > 0))
+            {
+                return ERR_MULTIPLE_EMPTY_AREAS;
+            }
+            continue;
+        }
+        if (c == '\r')
+        {
+            sl->pending_cr++;
+            continue;
+        }
+        bool digit = c >= '0' && c <= '9';
+        bool plain = c == '.' || MAP_CHAR_TERRAIN[(unsigned char)c] != 0;
+        if (sl->pending_cr > 0 || (c != '#' && !plain && !digit))
+        {
+            return ERR_INVALID_MAP;
+        }
+        long col = sl->col;
+        if (sl->width >= 0 && col >= sl->width)
+        {
+            return ERR_INVALID_MAP;
+        }
+        if (sl->width < 0 && !stream_labels_reserve(sl, col + 1))
+        {
+            return ERR_MEMORY;
+        }
+        // 与 is_empty 一致：空地、地形与玩家 1-9 都属于空区域
+        if (c == '#' || c == '0')
+        {
+            sl->cur[sl->col++] = -1;
+            continue;
+        }
+        int label = -1;
+        if (col > 0 && sl->cur[col - 1] >= 0)
+        {
+            label = sl->cur[col - 1];
+        }
+        if (sl->row > 0 && sl->prev[col] >= 0)
+        {
+            if (label < 0)
+            {
+                label = sl->prev[col];
+            }
+            else
+            {
+                uf_union(sl->parent, label, sl->prev[col]);
+            }
+        }
+        if (label < 0)
+        {
+            label = sl->labels++;
+            sl->parent[label] = label;
+        }
+        sl->cur[sl->col++] = label;
+    }
+    return ERR_NONE;
+}
+
+// 输入结束：处理没有换行符的最后一行，并把最后一行仍开放的区域计入总数
+static ErrorCode stream_validate_finish(StreamLabels *sl)
+{
+    if (sl->col > 0)
+    {
+        if (sl->width >= 0 && sl->col != sl->width)
+        {
+            return ERR_INVALID_MAP;
+        }
+        sl->width = sl->col;
+        sl->open = stream_end_row(sl, sl->width, sl->row > 0 ? sl->width : 0, &sl->closed);
+        sl->row++;
+        sl->col = 0;
+    }
+    return sl->closed + sl->open > 1 ? ERR_MULTIPLE_EMPTY_AREAS : ERR_NONE;
+}
+
+static void stream_labels_free(StreamLabels *sl)
+{
+    free(sl->prev), free(sl->cur), free(sl->parent), free(sl->remap);
+}
+
+// 流式判定地图是否只有一个空区域；输入可以是普通文本或压缩格式，rows/cols 返回地图尺寸
+ErrorCode stream_validate(FILE *fp, long *rows, long *cols)
+{
+    StreamLabels sl = {0};
+    sl.width = -1;
+    *rows = 0;
+    *cols = 0;
+    if (!stream_labels_reserve(&sl, 64))
+    {
+        return ERR_MEMORY;
+    }
+    ErrorCode err = read_map_input(fp, stream_validate_feed, &sl);
+    if (err == ERR_NONE)
+    {
+        err = stream_validate_finish(&sl);
+    }
+    stream_labels_free(&sl);
+    *rows = sl.row;
+    *cols = sl.width < 0 ? 0 : sl.width;
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+// 基准测试
+//
+// 按尺寸 × 地图类型生成测试地图（走廊迷宫、开阔房间、随机噪声修复后），
+// 分别对 load_map、validate_map、单次与批量 move_player、print_map 计时。
+// 每项先预热若干次，再重复 runs 次，输出中位数与分位数（微秒，CSV）。
+// ---------------------------------------------------------------------------
+
+#define BENCH_WARMUP 3
+#define BENCH_BATCH_MOVES 1000
+
+// 单调时钟，单位纳秒
+uint64_t now_ns(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+typedef enum
+{
+    BENCH_LOAD,
+    BENCH_VALIDATE,
+    BENCH_MOVE,
+    BENCH_MOVE_BATCH,
+    BENCH_PRINT,
+    BENCH_PHASES
+} BenchPhase;
+
+static const char *const BENCH_PHASE_NAMES[BENCH_PHASES] = {"load_map", "validate_map", "move_player",
+                                                            "move_player_batch", "print_map"};
+
+static int bench_cmp(const void *lhs, const void *rhs)
+{
+    uint64_t a = *(const uint64_t *)lhs, b = *(const uint64_t *)rhs;
+    return (a > b) - (a < b);
+}
+
+// 生成一张测试地图：pattern 0 走廊迷宫，1 开阔房间，2 随机噪声（修复为单一区域）
+static ErrorCode bench_make_map(int pattern, int size, uint64_t seed, Map *map)
+{
+    FILE *tmp = tmpfile();
+    if (!tmp)
+    {
+        return ERR_MAP_NOT_FOUND;
+    }
+    ErrorCode err = ERR_NONE;
+    if (pattern < 2)
+    {
+        GenerateOptions gen = {size, size, seed, pattern == 0 ? 0 : 60, 1};
+        err = generate_maze(tmp, &gen);
+    }
+    else
+    {
+        for (int i = 0; i < size; i++)
+        {
+            for (int j = 0; j < size; j++)
+            {
+                fputc(rng_next(&seed) % 100 < 35 ? '#' : '.', tmp);
+            }
+            fputc('\n', tmp);
+        }
+    }
+    rewind(tmp);
+    if (err == ERR_NONE)
+    {
+        err = load_map_stream(tmp, map);
+    }
+    fclose(tmp);
+    if (err != ERR_NONE || pattern < 2)
+    {
+        return err;
+    }
+    int removed;
+    err = repair_map(map, &removed);
+    for (int i = 1; i <= map->rows && err == ERR_NONE; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (map->cells[i][j] == '.')
+            {
+                set_cell(map, i, j, '1');
+                return ERR_NONE;
+            }
+        }
+    }
+    return err;
+}
+
+// 对一张地图的某个阶段计时一次，返回纳秒
+static uint64_t bench_once(BenchPhase phase, const Map *source, FILE *text, FILE *sink, uint64_t *rng)
+{
+    static Map map;
+    uint64_t start = 0, end = 0;
+    switch (phase)
+    {
+    case BENCH_LOAD:
+        rewind(text);
+        start = now_ns();
+        load_map_stream(text, &map);
+        end = now_ns();
+        break;
+    case BENCH_VALIDATE:
+        start = now_ns();
+        validate_map(source, NULL);
+        end = now_ns();
+        break;
+    case BENCH_MOVE:
+        map = *source;
+        start = now_ns();
+        move_player(&map, 1, DIR_NAMES[rng_next(rng) % 4]);
+        end = now_ns();
+        break;
+    case BENCH_MOVE_BATCH:
+    {
+        map = *source;
+        const char *dirs[BENCH_BATCH_MOVES];
+        for (int k = 0; k < BENCH_BATCH_MOVES; k++)
+        {
+            dirs[k] = DIR_NAMES[rng_next(rng) % 4];
+        }
+        start = now_ns();
+        for (int k = 0; k < BENCH_BATCH_MOVES; k++)
+        {
+            move_player(&map, 1, dirs[k]);
+        }
+        end = now_ns();
+        break;
+    }
+    case BENCH_PRINT:
+        rewind(sink);
+        start = now_ns();
+        fprint_map(sink, source);
+        fflush(sink);
+        end = now_ns();
+        break;
+    default:
+        break;
+    }
+    return end - start;
+}
+
+ErrorCode run_benchmarks(FILE *out, int runs)
+{
+    static const char *const PATTERN_NAMES[] = {"corridors", "rooms", "noise"};
+    static const int SIZES[] = {25, 50, 100};
+    static Map source;
+    uint64_t *samples = malloc(sizeof(uint64_t) * runs);
+    FILE *text = tmpfile();
+    FILE *sink = tmpfile();
+    if (!samples || !text || !sink)
+    {
+        free(samples);
+        if (text)
+        {
+            fclose(text);
+        }
+        if (sink)
+        {
+            fclose(sink);
+        }
+        return ERR_MAP_NOT_FOUND;
+    }
+
+    ErrorCode err = ERR_NONE;
+    uint64_t rng = 1;
+    fprintf(out, "pattern,rows,cols,phase,runs,median_us,p90_us,p99_us,min_us,max_us\n");
+    for (int pattern = 0; pattern < 3 && err == ERR_NONE; pattern++)
+    {
+        for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]) && err == ERR_NONE; s++)
+        {
+            err = bench_make_map(pattern, SIZES[s], 42 + s, &source);
+            if (err != ERR_NONE)
+            {
+                break;
+            }
+            rewind(text);
+            fprint_map(text, &source);
+            fflush(text);
+
+            for (int phase = 0; phase < BENCH_PHASES; phase++)
+            {
+                for (int k = 0; k < BENCH_WARMUP; k++)
+                {
+                    bench_once(phase, &source, text, sink, &rng);
+                }
+                for (int k = 0; k < runs; k++)
+                {
+                    samples[k] = bench_once(phase, &source, text, sink, &rng);
+                }
+                qsort(samples, runs, sizeof(uint64_t), bench_cmp);
+                fprintf(out, "%s,%d,%d,%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f\n", PATTERN_NAMES[pattern],
+                        source.rows, source.cols, BENCH_PHASE_NAMES[phase], runs,
+                        samples[runs / 2] / 1e3, samples[runs * 90 / 100] / 1e3,
+                        samples[runs * 99 / 100] / 1e3, samples[0] / 1e3, samples[runs - 1] / 1e3);
+            }
+        }
+    }
+
+    free(samples);
+    fclose(text);
+    fclose(sink);
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+// 延迟直方图与批处理模式
+//
+// --script 逐行读取命令并执行，适合批量回放或接在管道/FIFO 后常驻运行：
+//   move P DIR     移动玩家 P
+//   query R,C      输出格子内容
+//   reach P K      输出玩家 P 在 K 步内可到达的格子数
+//   set R,C=X      与 --set 相同的格子编辑
+//   step P R,C     玩家 P 沿 D* Lite 路径向 (R,C) 走一步，输出方向（到达时为 arrived）
+//   print          输出当前地图
+// reach、set 与 step 需要 grid 后端。同一玩家与终点的连续 step 之间保留 D* Lite
+// 的搜索状态，其间的 set 与移动经由 set_cell 观察者增量修复，而不是重新搜索。
+// 空行与 '#' 开头的行被忽略。每次移动、查询与打印的耗时记入直方图，
+// 退出时或收到 SIGUSR1 时把 p50/p99/p999/max 输出到 stderr。
+// ---------------------------------------------------------------------------
+
+static LatencyHistogram *latency_threads[MAX_LATENCY_THREADS];
+static atomic_int latency_thread_count;
+static _Thread_local LatencyHistogram latency_local;
+static _Thread_local int latency_slot = -1;
+static volatile sig_atomic_t latency_dump_requested;
+
+static const char *const LATENCY_NAMES[LATENCY_KINDS] = {"move", "query", "print"};
+
+// 数值所在桶：小于 2^SUB_BITS 时精确，之后按最高位分段、取次高 SUB_BITS 位作子桶
+static int latency_bucket(uint64_t ns)
+{
+    if (ns < (1u << LATENCY_SUB_BITS))
+    {
+        return (int)ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) + (int)((ns >> shift) & ((1u << LATENCY_SUB_BITS) - 1));
+}
+
+// 桶内的最大值（HDR 的 "highest equivalent value"）
+static uint64_t latency_bucket_high(int bucket)
+{
+    if (bucket < (1 << LATENCY_SUB_BITS))
+    {
+        return (uint64_t)bucket;
+    }
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    uint64_t sub = (uint64_t)(bucket & ((1 << LATENCY_SUB_BITS) - 1)) | (1u << LATENCY_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+// 记录一次耗时；线程第一次记录时把自己的直方图登记到全局表（只用一次原子加）
+void latency_record(LatencyKind kind, uint64_t ns)
+{
+    if (latency_slot < 0)
+    {
+        int slot = atomic_fetch_add(&latency_thread_count, 1);
+        if (slot >= MAX_LATENCY_THREADS)
+        {
+            return; // 登记表已满：该线程不计入，下次调用会再次尝试并同样放弃
+        }
+        latency_threads[slot] = &latency_local;
+        latency_slot = slot;
+    }
+    // 每个直方图只有一个写者，relaxed 原子操作保证合并时读到完整的计数
+    atomic_fetch_add_explicit(&latency_local.counts[kind][latency_bucket(ns)], 1, memory_order_relaxed);
+    if (ns > atomic_load_explicit(&latency_local.max_ns[kind], memory_order_relaxed))
+    {
+        atomic_store_explicit(&latency_local.max_ns[kind], ns, memory_order_relaxed);
+    }
+}
+
+// 在合并后的分布中找到第 q 分位所在桶（q 为千分比的十倍，例如 999 表示 99.9%）
+static uint64_t latency_percentile(const uint64_t *counts, uint64_t total, uint64_t max_ns, int q)
+{
+    uint64_t rank = (total * (uint64_t)q + 999) / 1000; // 向上取整，至少为 1
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+    {
+        seen += counts[b];
+        if (seen >= rank)
+        {
+            uint64_t high = latency_bucket_high(b);
+            return high < max_ns ? high : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+// 合并所有线程的直方图并输出各类操作的分位数（纳秒）
+void print_latency_report(void)
+{
+    static uint64_t counts[LATENCY_BUCKETS];
+    int threads = atomic_load(&latency_thread_count);
+    if (threads > MAX_LATENCY_THREADS)
+    {
+        threads = MAX_LATENCY_THREADS;
+    }
+    fflush(stdout);
+    for (int kind = 0; kind < LATENCY_KINDS; kind++)
+    {
+        uint64_t total = 0, max_ns = 0;
+        memset(counts, 0, sizeof(counts));
+        for (int t = 0; t < threads; t++)
+        {
+            const LatencyHistogram *h = latency_threads[t];
+            if (h == NULL)
+            {
+                continue; // 已领取槽位但尚未写入指针
+            }
+            for (int b = 0; b < LATENCY_BUCKETS; b++)
+            {
+                uint64_t c = atomic_load_explicit(&h->counts[kind][b], memory_order_relaxed);
+                counts[b] += c;
+                total += c;
+            }
+            uint64_t m = atomic_load_explicit(&h->max_ns[kind], memory_order_relaxed);
+            max_ns = m > max_ns ? m : max_ns;
+        }
+        if (total == 0)
+        {
+            fprintf(stderr, "latency %s count 0\n", LATENCY_NAMES[kind]);
+            continue;
+        }
+        fprintf(stderr, "latency %s count %llu p50_ns %llu p99_ns %llu p999_ns %llu max_ns %llu\n",
+                LATENCY_NAMES[kind], (unsigned long long)total,
+                (unsigned long long)latency_percentile(counts, total, max_ns, 500),
+                (unsigned long long)latency_percentile(counts, total, max_ns, 990),
+                (unsigned long long)latency_percentile(counts, total, max_ns, 999),
+                (unsigned long long)max_ns);
+    }
+}
+
+#ifdef SIGUSR1
+static void latency_signal_handler(int sig)
+{
+    (void)sig;
+    latency_dump_requested = 1; // 只设置标志，报告在主循环中输出
+}
+#endif
+
+// 读取一行命令；被信号打断时先输出报告再继续读，已读到的部分不会丢失
+static bool script_read_line(FILE *fp, char *line, size_t size)
+{
+    size_t len = 0;
+    while (len + 1 < size)
+    {
+        int c = getc(fp);
+        if (c == EOF)
+        {
+            if (ferror(fp) && latency_dump_requested)
+            {
+                clearerr(fp);
+                latency_dump_requested = 0;
+                print_latency_report();
+                continue;
+            }
+            break;
+        }
+        line[len++] = (char)c;
+        if (c == '\n')
+        {
+            break;
+        }
+    }
+    line[len] = '\0';
+    return len > 0;
+}
+
+// 脚本中的玩家编号与 -p 一样只能是 0~9，否则 '0' + player 会写出非法字符
+static bool script_check_player(int player, int line_number)
+{
+    if (player < 0 || player > 9)
+    {
+        fprintf(stderr, "line %d: Player must be a single digit between 0 and 9.\n", line_number);
+        return false;
+    }
+    return true;
+}
+
+// step 命令的 D* Lite 状态，active 时作为观察者挂在地图上
+static DStarLite script_route;
+static bool script_route_active;
+
+// 玩家 player 沿 D* Lite 路径走一步；玩家或终点变化时重新初始化搜索
+static void script_step(Map *map, int player, int gx, int gy, int line_number)
+{
+    int sx = -1, sy = -1;
+    for (int i = 1; i <= map->rows && sx == -1; i++)
+    {
+        for (int j = 1; j <= map->cols; j++)
+        {
+            if (is_player(i, j, map, player))
+            {
+                sx = i;
+                sy = j;
+                break;
+            }
+        }
+    }
+    if (sx == -1)
+    {
+        fprintf(stderr, "line %d: player not found\n", line_number);
+        return;
+    }
+    if (gx < 1 || gx > map->rows || gy < 1 || gy > map->cols)
+    {
+        fprintf(stderr, "line %d: invalid cell\n", line_number);
+        return;
+    }
+    DStarLite *ds = &script_route;
+    if (!script_route_active || ds->map != map || ds->player != player || ds->goal_x != gx || ds->goal_y != gy)
+    {
+        if (script_route_active)
+        {
+            remove_cell_observer(dstar_cell_changed, ds);
+        }
+        dstar_init(ds, map, player, sx, sy, gx, gy);
+        add_cell_observer(dstar_cell_changed, ds);
+        script_route_active = true;
+    }
+    else if (sx != ds->start_x || sy != ds->start_y)
+    {
+        dstar_set_start(ds, sx, sy); // 玩家被 move 命令移动过
+    }
+    int dir;
+    if (dstar_next_step(ds, &dir) != ERR_NONE)
+    {
+        fprintf(stderr, "line %d: no path\n", line_number);
+        return;
+    }
+    if (dir == DIR_WAIT)
+    {
+        printf("arrived\n");
+        return;
+    }
+    move_player(map, player, DIR_NAMES[dir]);
+    dstar_set_start(ds, sx + DIR_DX[dir], sy + DIR_DY[dir]);
+    printf("%s\n", DIR_NAMES[dir]);
+}
+
+// 执行一条命令；命令本身失败时输出到 stderr 并继续执行后续命令
+static void script_execute(MapBackend *b, char *line, int line_number)
+{
+    char command[16], arg[64], extra;
+    int player, x, y, k;
+    trim_newline(line);
+    if (line[0] == '\0' || line[0] == '#')
+    {
+        return;
+    }
+    if (sscanf(line, "move %d %63s %c", &player, arg, &extra) == 2)
+    {
+        if (!script_check_player(player, line_number))
+        {
+            return;
+        }
+        if (backend_move_player(b, player, arg) != ERR_NONE)
+        {
+            fprintf(stderr, "line %d: move failed\n", line_number);
+        }
+    }
+    else if (sscanf(line, "query %d,%d %c", &x, &y, &extra) == 2)
+    {
+        uint64_t start = now_ns();
+        if (x < 1 || x > b->rows || y < 1 || y > b->cols)
+        {
+            fprintf(stderr, "line %d: invalid cell\n", line_number);
+            return;
+        }
+        printf("%d,%d %c\n", x, y, backend_display(b, x, y));
+        latency_record(LATENCY_QUERY, now_ns() - start);
+    }
+    else if (sscanf(line, "reach %d %d %c", &player, &k, &extra) == 2 && k >= 0)
+    {
+        static BitGrid reach;
+        int count;
+        if (!script_check_player(player, line_number))
+        {
+            return;
+        }
+        Map *map = grid_backend_map(b);
+        if (map == NULL)
+        {
+            fprintf(stderr, "line %d: reach needs the grid backend\n", line_number);
+            return;
+        }
+        uint64_t start = now_ns();
+        ErrorCode err = reachable_within(map, player, k, &reach, &count);
+        latency_record(LATENCY_QUERY, now_ns() - start);
+        if (err != ERR_NONE)
+        {
+            fprintf(stderr, "line %d: player not found\n", line_number);
+            return;
+        }
+        printf("reachable %d\n", count);
+    }
+    else if (sscanf(line, "set %63s %c", arg, &extra) == 1)
+    {
+        Edit edit;
+        Map *map = grid_backend_map(b);
+        if (map == NULL)
+        {
+            fprintf(stderr, "line %d: set needs the grid backend\n", line_number);
+            return;
+        }
+        if (parse_edit(arg, &edit) != ERR_NONE || edit_cell(map, &edit) != ERR_NONE)
+        {
+            fprintf(stderr, "line %d: edit failed\n", line_number);
+        }
+    }
+    else if (sscanf(line, "step %d %d,%d %c", &player, &x, &y, &extra) == 3)
+    {
+        Map *map = grid_backend_map(b);
+        if (!script_check_player(player, line_number))
+        {
+            return;
+        }
+        if (map == NULL)
+        {
+            fprintf(stderr, "line %d: step needs the grid backend\n", line_number);
+            return;
+        }
+        script_step(map, player, x, y, line_number);
+    }
+    else if (sscanf(line, "%15s %c", command, &extra) == 1 && strcmp(command, "print") == 0)
+    {
+        backend_print(b);
+    }
+    else
+    {
+        fprintf(stderr, "line %d: unknown command\n", line_number);
+    }
+}
+
+// 批处理主循环：filename 为 "-" 时从 stdin 读取，直到输入结束
+ErrorCode run_script(MapBackend *b, const char *filename)
+{
+    FILE *fp = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    if (!fp)
+    {
+        return ERR_MAP_NOT_FOUND;
+    }
+#if defined(SIGUSR1) && !defined(_WIN32)
+    // 不设置 SA_RESTART：常驻等待输入时信号能打断阻塞的读取并立即输出报告
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = latency_signal_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+#endif
+
+    char line[1024];
+    int line_number = 0;
+    while (script_read_line(fp, line, sizeof(line)))
+    {
+        line_number++;
+        script_execute(b, line, line_number);
+        fflush(stdout); // 管道另一端按行等待结果
+        if (latency_dump_requested)
+        {
+            latency_dump_requested = 0;
+            print_latency_report();
+        }
+    }
+    if (fp != stdin)
+    {
+        fclose(fp);
+    }
+    return ERR_NONE;
+}
+
+// ---------------------------------------------------------------------------
+// 存储后端
+//
+// 所有后端都通过 MapBackendOps 提供按格读写；加载、验证、移动与打印在此基础上
+// 通用实现，后端可以用自己的结构提供更快的 find 与 validate。
+//   grid  包装定长的 Map（默认，受 MAX_MAP_DIM 限制）
+//   runs  每行存储空格子的区间列表，另记玩家与地形格；验证按区间做连通标记
+//   tiles 64x64 分块存放在哈希表中，全墙块不存储、全空块只记一个字符，其余块首次写入时分配
+//   packed 每格 4 位、每字节两格的稠密存储，内存为 grid 的四分之一（cells 与 terrain 合并）
+// ---------------------------------------------------------------------------
+
+// 格子的显示字符：地形格显示地形
+char backend_display(const MapBackend *b, long x, long y)
+{
+    char c = b->ops->cell(b, x, y);
+    return c == '.' ? TERRAIN_CHARS[b->ops->terrain(b, x, y)] : c;
+}
+
+// 第 x 行的显示字符写入 out（cols 个）
+static void backend_row_text(const MapBackend *b, long x, char *out)
+{
+    if (b->ops->row_text != NULL)
+    {
+        b->ops->row_text(b, x, out);
+        return;
+    }
+    for (long y = 1; y <= b->cols; y++)
+    {
+        out[y - 1] = backend_display(b, x, y);
+    }
+}
+
+// 加载时逐行拼接解码后的文本，校验字符与行宽后交给后端
+typedef struct
+{
+    MapBackend *backend;
+    char *line;
+    size_t len;
+    size_t cap;
+} BackendLoader;
+
+static ErrorCode backend_loader_row(BackendLoader *loader)
+{
+    MapBackend *b = loader->backend;
+    size_t len = loader->len;
+    loader->len = 0;
+    while (len > 0 && loader->line[len - 1] == '\r')
+    {
+        len--;
+    }
+    if (len == 0)
+    {
+        return ERR_NONE; // 跳过空行
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)loader->line[i];
+        if (c != '#' && c != '.' && MAP_CHAR_TERRAIN[c] == 0 && !(c >= '0' && c <= '9'))
+        {
+            return ERR_INVALID_MAP;
+        }
+    }
+    if (b->rows == 0)
+    {
+        b->cols = (long)len;
+    }
+    else if ((long)len != b->cols)
+    {
+        return ERR_INVALID_MAP;
+    }
+    ErrorCode err = b->ops->append_row(b, loader->line);
+    if (err == ERR_NONE)
+    {
+        b->rows++;
+    }
+    return err;
+}
+
+static ErrorCode backend_loader_feed(void *ctx, const char *data, size_t len)
+{
+    BackendLoader *loader = ctx;
+    for (size_t k = 0; k < len; k++)
+    {
+        if (data[k] == '\n')
+        {
+            ErrorCode err = backend_loader_row(loader);
+            if (err != ERR_NONE)
+            {
+                return err;
+            }
+            continue;
+        }
+        if (loader->len == loader->cap)
+        {
+            size_t cap = loader->cap * 2;
+            char *line = realloc(loader->line, cap);
+            if (line == NULL)
+            {
+                return ERR_MEMORY;
+            }
+            loader->line = line;
+            loader->cap = cap;
+        }
+        loader->line[loader->len++] = data[k];
+    }
+    return ERR_NONE;
+}
+
+// 从流中加载地图到后端（支持 read_map_input 识别的所有格式）
+ErrorCode backend_load(MapBackend *b, FILE *fp)
+{
+    BackendLoader loader = {b, malloc(256), 0, 256};
+    if (loader.line == NULL)
+    {
+        return ERR_MEMORY;
+    }
+    b->rows = 0;
+    b->cols = 0;
+    ErrorCode err = read_map_input(fp, backend_loader_feed, &loader);
+    if (err == ERR_NONE)
+    {
+        err = backend_loader_row(&loader); // 最后一行可以没有换行符
+    }
+    if (err == ERR_NONE && b->ops->finish_load != NULL)
+    {
+        b->ops->finish_load(b);
+    }
+    free(loader.line);
+    return err;
+}
+
+// 判断是否只有一个空区域；后端没有专门实现时按行取出显示字符交给流式验证
+ErrorCode backend_validate(const MapBackend *b)
+{
+    if (b->ops->validate != NULL)
+    {
+        return b->ops->validate(b);
+    }
+    StreamLabels sl = {0};
+    sl.width = -1;
+    char *line = malloc(b->cols + 1);
+    ErrorCode err = line != NULL && stream_labels_reserve(&sl, b->cols + 1) ? ERR_NONE : ERR_MEMORY;
+    for (long x = 1; x <= b->rows && err == ERR_NONE; x++)
+    {
+        backend_row_text(b, x, line);
+        line[b->cols] = '\n';
+        err = stream_validate_feed(&sl, line, b->cols + 1);
+    }
+    if (err == ERR_NONE)
+    {
+        err = stream_validate_finish(&sl);
+    }
+    stream_labels_free(&sl);
+    free(line);
+    return err;
+}
+
+// 行优先查找第一个 cell 为 c 的格子
+static bool backend_find(const MapBackend *b, char c, long *x, long *y)
+{
+    if (b->ops->find != NULL)
+    {
+        return b->ops->find(b, c, x, y);
+    }
+    for (long i = 1; i <= b->rows; i++)
+    {
+        for (long j = 1; j <= b->cols; j++)
+        {
+            if (b->ops->cell(b, i, j) == c)
+            {
+                *x = i;
+                *y = j;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// 与 move_player_once 的规则相同，只通过后端接口访问地图
+static ErrorCode backend_move_once(MapBackend *b, int player, const char *direction)
+{
+    int dir = parse_direction(direction);
+    if (dir < 0)
+    {
+        return ERR_MOVE_FAILED;
+    }
+    char playerChar = player + '0';
+    long x, y;
+    if (!backend_find(b, playerChar, &x, &y))
+    {
+        // 地图中没有该玩家：放在第一个空地
+        if (!backend_find(b, '.', &x, &y))
+        {
+            return ERR_MOVE_FAILED;
+        }
+        return b->ops->set_cell(b, x, y, playerChar);
+    }
+    long tx = x + DIR_DX[dir], ty = y + DIR_DY[dir];
+    if (tx < 1 || tx > b->rows || ty < 1 || ty > b->cols || b->ops->cell(b, tx, ty) != '.')
+    {
+        return ERR_MOVE_FAILED;
+    }
+    // 先写目标格再清空原位：清空是最后一次写入，tiles 可以放心地在此时压缩分块
+    ErrorCode err = b->ops->set_cell(b, tx, ty, playerChar);
+    if (err == ERR_NONE)
+    {
+        err = b->ops->set_cell(b, x, y, '.');
+        if (err != ERR_NONE)
+        {
+            b->ops->set_cell(b, tx, ty, '.'); // 撤销目标格的写入，恢复不需要新内存
+        }
+    }
+    return err;
+}
+
+ErrorCode backend_move_player(MapBackend *b, int player, const char *direction)
+{
+    Map *map = grid_backend_map(b);
+    if (map != NULL)
+    {
+        return move_player(map, player, direction);
+    }
+    uint64_t start = now_ns();
+    ErrorCode err = backend_move_once(b, player, direction);
+    uint64_t elapsed = now_ns() - start;
+    run_stats.move_ns += elapsed;
+    run_stats.moves++;
+    latency_record(LATENCY_MOVE, elapsed);
+    return err;
+}
+
+void backend_print(const MapBackend *b)
+{
+    Map *map = grid_backend_map(b);
+    if (map != NULL)
+    {
+        print_map(map);
+        return;
+    }
+    uint64_t start = now_ns();
+    char *line = malloc(b->cols + 1);
+    for (long x = 1; x <= b->rows; x++)
+    {
+        if (line == NULL)
+        {
+            // 行缓冲区分配失败时逐个字符输出，地图照样完整打印
+            for (long y = 1; y <= b->cols; y++)
+            {
+                putchar(backend_display(b, x, y));
+            }
+            putchar('\n');
+            continue;
+        }
+        backend_row_text(b, x, line);
+        line[b->cols] = '\n';
+        fwrite(line, 1, b->cols + 1, stdout);
+    }
+    free(line);
+    uint64_t elapsed = now_ns() - start;
+    run_stats.print_ns += elapsed;
+    latency_record(LATENCY_PRINT, elapsed);
+}
+
+// grid：包装 Map ------------------------------------------------------------
+
+static const MapBackendOps GRID_BACKEND;
+
+static MapBackend *grid_create(void)
+{
+    GridBackend *g = malloc(sizeof(GridBackend));
+    Map *map = malloc(sizeof(Map));
+    if (g == NULL || map == NULL)
+    {
+        free(g);
+        free(map);
+        return NULL;
+    }
+    map->rows = 0;
+    map->cols = 0;
+    grid_backend_wrap(g, map);
+    g->owned = true;
+    return &g->base;
+}
+
+static ErrorCode grid_append_row(MapBackend *b, const char *row)
+{
+    Map *map = ((GridBackend *)b)->map;
+    if (b->cols > MAX_MAP_DIM || b->rows >= MAX_MAP_DIM)
+    {
+        return ERR_INVALID_MAP;
+    }
+    map->rows = (int)b->rows + 1;
+    map->cols = (int)b->cols;
+    for (long j = 0; j < b->cols; j++)
+    {
+        unsigned char terrain = MAP_CHAR_TERRAIN[(unsigned char)row[j]];
+        map->cells[map->rows][j + 1] = terrain ? '.' : row[j];
+        map->terrain[map->rows][j + 1] = terrain;
+    }
+    return ERR_NONE;
+}
+
+static void grid_finish_load(MapBackend *b)
+{
+    map_build_neighbours(((GridBackend *)b)->map);
+}
+
+static char grid_cell(const MapBackend *b, long x, long y)
+{
+    return ((const GridBackend *)b)->map->cells[x][y];
+}
+
+static int grid_terrain(const MapBackend *b, long x, long y)
+{
+    return ((const GridBackend *)b)->map->terrain[x][y];
+}
+
+static ErrorCode grid_set_cell(MapBackend *b, long x, long y, char c)
+{
+    set_cell(((GridBackend *)b)->map, (int)x, (int)y, c);
+    return ERR_NONE;
+}
+
+static ErrorCode grid_validate(const MapBackend *b)
+{
+    return validate_map(((const GridBackend *)b)->map, NULL);
+}
+
+static void grid_destroy(MapBackend *b)
+{
+    GridBackend *g = (GridBackend *)b;
+    if (g->owned)
+    {
+        free(g->map);
+        free(g);
+    }
+}
+
+static const MapBackendOps GRID_BACKEND = {"grid", grid_create, grid_append_row, grid_finish_load, grid_cell,
+                                           grid_terrain, grid_set_cell, NULL, NULL, grid_validate, grid_destroy};
+
+// 把已加载的 Map 包装成后端（不接管其内存）
+void grid_backend_wrap(GridBackend *g, Map *map)
+{
+    g->base.ops = &GRID_BACKEND;
+    g->base.rows = map->rows;
+    g->base.cols = map->cols;
+    g->map = map;
+    g->owned = false;
+}
+
+// 后端为 grid 时返回其 Map，否则返回 NULL
+Map *grid_backend_map(const MapBackend *b)
+{
+    return b->ops == &GRID_BACKEND ? ((const GridBackend *)b)->map : NULL;
+}
+
+// runs：按行的空格子区间 ------------------------------------------------------
+
+// 一段连续的空格子（is_empty 为真），列号闭区间 [start, end]
+typedef struct
+{
+    long start;
+    long end;
+} CellRun;
+
+// 与默认值不同的格子：玩家数字，或地形不是平地
+typedef struct
+{
+    long col;
+    char cell;
+    unsigned char terrain;
+} CellMark;
+
+typedef struct
+{
+    CellRun *runs;
+    int run_count;
+    int run_cap;
+    CellMark *marks;
+    int mark_count;
+    int mark_cap;
+} RunRow;
+
+typedef struct
+{
+    MapBackend base;
+    RunRow *rows;
+    long row_cap;
+    long run_total;
+} RunMap;
+
+static bool cell_is_open(char c)
+{
+    return c == '.' || (c >= '1' && c <= '9');
+}
+
+// 按需扩大数组容量；elem 为元素大小
+static bool grow_array(void **items, int *cap, int need, size_t elem)
+{
+    if (need <= *cap)
+    {
+        return true;
+    }
+    int new_cap = *cap > 0 ? *cap * 2 : 4;
+    while (new_cap < need)
+    {
+        new_cap *= 2;
+    }
+    void *grown = realloc(*items, elem * new_cap);
+    if (grown == NULL)
+    {
+        return false;
+    }
+    *items = grown;
+    *cap = new_cap;
+    return true;
+}
+
+// 二分查找：返回 end >= y 的第一个区间下标
+static int run_lower_bound(const RunRow *row, long y)
+{
+    int lo = 0, hi = row->run_count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (row->runs[mid].end < y)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// 二分查找：返回 col >= y 的第一个标记下标
+static int mark_lower_bound(const RunRow *row, long y)
+{
+    int lo = 0, hi = row->mark_count;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (row->marks[mid].col < y)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static MapBackend *runs_create(void);
+
+static ErrorCode runs_append_row(MapBackend *b, const char *row)
+{
+    RunMap *rm = (RunMap *)b;
+    if (b->rows == rm->row_cap)
+    {
+        long cap = rm->row_cap > 0 ? rm->row_cap * 2 : 64;
+        RunRow *rows = realloc(rm->rows, sizeof(RunRow) * cap);
+        if (rows == NULL)
+        {
+            return ERR_MEMORY;
+        }
+        rm->rows = rows;
+        rm->row_cap = cap;
+    }
+    RunRow *r = &rm->rows[b->rows];
+    memset(r, 0, sizeof(*r));
+    long start = -1;
+    for (long j = 1; j <= b->cols + 1; j++)
+    {
+        char c = j <= b->cols ? row[j - 1] : '#';
+        unsigned char terrain = MAP_CHAR_TERRAIN[(unsigned char)c];
+        char cell = terrain ? '.' : c;
+        if (cell_is_open(cell) && start < 0)
+        {
+            start = j;
+        }
+        else if (!cell_is_open(cell) && start >= 0)
+        {
+            if (!grow_array((void **)&r->runs, &r->run_cap, r->run_count + 1, sizeof(CellRun)))
+            {
+                return ERR_MEMORY;
+            }
+            r->runs[r->run_count++] = (CellRun){start, j - 1};
+            rm->run_total++;
+            start = -1;
+        }
+        if (j <= b->cols && (cell != '.' && cell != '#' ? true : terrain != TERRAIN_PLAIN))
+        {
+            if (!grow_array((void **)&r->marks, &r->mark_cap, r->mark_count + 1, sizeof(CellMark)))
+            {
+                return ERR_MEMORY;
+            }
+            r->marks[r->mark_count++] = (CellMark){j, cell, terrain};
+        }
+    }
+    return ERR_NONE;
+}
+
+static char runs_cell(const MapBackend *b, long x, long y)
+{
+    const RunRow *r = &((const RunMap *)b)->rows[x - 1];
+    int m = mark_lower_bound(r, y);
+    if (m < r->mark_count && r->marks[m].col == y)
+    {
+        return r->marks[m].cell;
+    }
+    int k = run_lower_bound(r, y);
+    return k < r->run_count && r->runs[k].start <= y ? '.' : '#';
+}
+
+static int runs_terrain(const MapBackend *b, long x, long y)
+{
+    const RunRow *r = &((const RunMap *)b)->rows[x - 1];
+    int m = mark_lower_bound(r, y);
+    return m < r->mark_count && r->marks[m].col == y ? r->marks[m].terrain : TERRAIN_PLAIN;
+}
+
+// 把第 y 列加入空格子区间，与左右相邻的区间合并
+static ErrorCode runs_open(RunMap *rm, RunRow *r, long y)
+{
+    int k = run_lower_bound(r, y - 1);
+    bool left = k < r->run_count && r->runs[k].end == y - 1;
+    int right_index = left ? k + 1 : k;
+    bool right = right_index < r->run_count && r->runs[right_index].start == y + 1;
+    if (left && right)
+    {
+        r->runs[k].end = r->runs[k + 1].end;
+        memmove(&r->runs[k + 1], &r->runs[k + 2], sizeof(CellRun) * (r->run_count - k - 2));
+        r->run_count--;
+        rm->run_total--;
+    }
+    else if (left)
+    {
+        r->runs[k].end = y;
+    }
+    else if (right)
+    {
+        r->runs[right_index].start = y;
+    }
+    else
+    {
+        if (!grow_array((void **)&r->runs, &r->run_cap, r->run_count + 1, sizeof(CellRun)))
+        {
+            return ERR_MEMORY;
+        }
+        memmove(&r->runs[k + 1], &r->runs[k], sizeof(CellRun) * (r->run_count - k));
+        r->runs[k] = (CellRun){y, y};
+        r->run_count++;
+        rm->run_total++;
+    }
+    return ERR_NONE;
+}
+
+// 把第 y 列从所在区间中移除，必要时拆成两段
+static ErrorCode runs_close(RunMap *rm, RunRow *r, long y)
+{
+    int k = run_lower_bound(r, y);
+    CellRun run = r->runs[k];
+    if (run.start == y && run.end == y)
+    {
+        memmove(&r->runs[k], &r->runs[k + 1], sizeof(CellRun) * (r->run_count - k - 1));
+        r->run_count--;
+        rm->run_total--;
+    }
+    else if (run.start == y)
+    {
+        r->runs[k].start = y + 1;
+    }
+    else if (run.end == y)
+    {
+        r->runs[k].end = y - 1;
+    }
+    else
+    {
+        if (!grow_array((void **)&r->runs, &r->run_cap, r->run_count + 1, sizeof(CellRun)))
+        {
+            return ERR_MEMORY;
+        }
+        memmove(&r->runs[k + 2], &r->runs[k + 1], sizeof(CellRun) * (r->run_count - k - 1));
+        r->runs[k].end = y - 1;
+        r->runs[k + 1] = (CellRun){y + 1, run.end};
+        r->run_count++;
+        rm->run_total++;
+    }
+    return ERR_NONE;
+}
+
+static ErrorCode runs_set_cell(MapBackend *b, long x, long y, char c)
+{
+    RunMap *rm = (RunMap *)b;
+    RunRow *r = &rm->rows[x - 1];
+    char old = runs_cell(b, x, y);
+    if (old == c)
+    {
+        return ERR_NONE;
+    }
+    // 标记：地形保持不变，玩家数字或非平地地形需要标记。先预留标记空间，
+    // 区间修改成功后不再有会失败的分配
+    int m = mark_lower_bound(r, y);
+    bool has_mark = m < r->mark_count && r->marks[m].col == y;
+    unsigned char terrain = has_mark ? r->marks[m].terrain : TERRAIN_PLAIN;
+    bool need_mark = (c != '.' && c != '#') || terrain != TERRAIN_PLAIN;
+    if (!has_mark && need_mark &&
+        !grow_array((void **)&r->marks, &r->mark_cap, r->mark_count + 1, sizeof(CellMark)))
+    {
+        return ERR_MEMORY;
+    }
+    if (cell_is_open(old) != cell_is_open(c))
+    {
+        ErrorCode err = cell_is_open(c) ? runs_open(rm, r, y) : runs_close(rm, r, y);
+        if (err != ERR_NONE)
+        {
+            return err;
+        }
+    }
+    if (has_mark && need_mark)
+    {
+        r->marks[m].cell = c;
+    }
+    else if (has_mark)
+    {
+        memmove(&r->marks[m], &r->marks[m + 1], sizeof(CellMark) * (r->mark_count - m - 1));
+        r->mark_count--;
+    }
+    else if (need_mark)
+    {
+        memmove(&r->marks[m + 1], &r->marks[m], sizeof(CellMark) * (r->mark_count - m));
+        r->marks[m] = (CellMark){y, c, terrain};
+        r->mark_count++;
+    }
+    return ERR_NONE;
+}
+
+// 玩家只存在于标记中；空地是区间内第一个没有玩家标记的格子
+static bool runs_find(const MapBackend *b, char c, long *x, long *y)
+{
+    const RunMap *rm = (const RunMap *)b;
+    for (long i = 0; i < b->rows; i++)
+    {
+        const RunRow *r = &rm->rows[i];
+        if (c != '.')
+        {
+            for (int m = 0; m < r->mark_count; m++)
+            {
+                if (r->marks[m].cell == c)
+                {
+                    *x = i + 1;
+                    *y = r->marks[m].col;
+                    return true;
+                }
+            }
+            continue;
+        }
+        int m = 0;
+        for (int k = 0; k < r->run_count; k++)
+        {
+            for (long j = r->runs[k].start; j <= r->runs[k].end; j++)
+            {
+                while (m < r->mark_count && r->marks[m].col < j)
+                {
+                    m++;
+                }
+                if (m >= r->mark_count || r->marks[m].col != j || r->marks[m].cell == '.')
+                {
+                    *x = i + 1;
+                    *y = j;
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// 按区间的连通标记：相邻两行列范围重叠的区间属于同一区域
+static ErrorCode runs_validate(const MapBackend *b)
+{
+    const RunMap *rm = (const RunMap *)b;
+    if (rm->run_total == 0)
+    {
+        return ERR_NONE;
+    }
+    int *parent = malloc(sizeof(int) * rm->run_total);
+    if (parent == NULL)
+    {
+        return ERR_MEMORY;
+    }
+    long base = 0, prev_base = 0;
+    long areas = 0;
+    for (long i = 0; i < b->rows; i++)
+    {
+        const RunRow *r = &rm->rows[i];
+        for (int k = 0; k < r->run_count; k++)
+        {
+            parent[base + k] = (int)(base + k);
+        }
+        areas += r->run_count;
+        if (i > 0)
+        {
+            // 双指针扫描上一行与本行的区间
+            const RunRow *p = &rm->rows[i - 1];
+            int a = 0, c = 0;
+            while (a < p->run_count && c < r->run_count)
+            {
+                if (p->runs[a].start <= r->runs[c].end && r->runs[c].start <= p->runs[a].end &&
+                    uf_union(parent, (int)(prev_base + a), (int)(base + c)))
+                {
+                    areas--;
+                }
+                if (p->runs[a].end < r->runs[c].end)
+                {
+                    a++;
+                }
+                else
+                {
+                    c++;
+                }
+            }
+        }
+        prev_base = base;
+        base += r->run_count;
+    }
+    free(parent);
+    return areas > 1 ? ERR_MULTIPLE_EMPTY_AREAS : ERR_NONE;
+}
+
+static void runs_destroy(MapBackend *b)
+{
+    RunMap *rm = (RunMap *)b;
+    for (long i = 0; i < b->rows; i++)
+    {
+        free(rm->rows[i].runs);
+        free(rm->rows[i].marks);
+    }
+    free(rm->rows);
+    free(rm);
+}
+
+static const MapBackendOps RUNS_BACKEND = {"runs", runs_create, runs_append_row, NULL, runs_cell, runs_terrain,
+                                           runs_set_cell, runs_find, NULL, runs_validate, runs_destroy};
+
+static MapBackend *runs_create(void)
+{
+    RunMap *rm = calloc(1, sizeof(RunMap));
+    if (rm == NULL)
+    {
+        return NULL;
+    }
+    rm->base.ops = &RUNS_BACKEND;
+    return &rm->base;
+}
+
+// tiles：哈希表中的 64x64 分块 ---------------------------------------------------
+
+#define TILE_SHIFT 6
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE_SIZE - 1)
+
+typedef struct
+{
+    char cells[TILE_SIZE][TILE_SIZE];
+    unsigned char terrain[TILE_SIZE][TILE_SIZE];
+} TileData;
+
+// 哈希表槽位：data 为 NULL 时整块都是 fill（'.' 或 '#'，地形为平地）
+typedef struct
+{
+    bool used;
+    long tr, tc; // 分块行列号（0 起始）
+    char fill;
+    TileData *data;
+} TileSlot;
+
+typedef struct
+{
+    MapBackend base;
+    TileSlot *slots;
+    size_t capacity; // 2 的幂
+    size_t count;
+    size_t materialized;
+} TileMap;
+
+static size_t tile_hash(long tr, long tc)
+{
+    uint64_t h = (uint64_t)tr * 0x9E3779B97F4A7C15ull ^ (uint64_t)tc;
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ull;
+    return (size_t)(h ^ (h >> 29));
+}
+
+// 线性探测查找分块；不存在时返回 NULL
+static TileSlot *tile_lookup(const TileMap *tm, long tr, long tc)
+{
+    if (tm->capacity == 0)
+    {
+        return NULL;
+    }
+    for (size_t i = tile_hash(tr, tc) & (tm->capacity - 1);; i = (i + 1) & (tm->capacity - 1))
+    {
+        TileSlot *slot = &tm->slots[i];
+        if (!slot->used)
+        {
+            return NULL;
+        }
+        if (slot->tr == tr && slot->tc == tc)
+        {
+            return slot;
+        }
+    }
+}
+
+// 查找或插入分块（新分块为全墙），负载超过一半时扩容
+static TileSlot *tile_insert(TileMap *tm, long tr, long tc)
+{
+    TileSlot *slot = tile_lookup(tm, tr, tc);
+    if (slot != NULL)
+    {
+        return slot;
+    }
+    if ((tm->count + 1) * 2 > tm->capacity)
     {
-        trim_newline(buffer);
-        int len = strlen(buffer);
-        if (len == 0)
-            continue; // 跳过空行
-        if (map->rows == 0)
+        size_t capacity = tm->capacity > 0 ? tm->capacity * 2 : 64;
+        TileSlot *slots = calloc(capacity, sizeof(TileSlot));
+        if (slots == NULL)
+        {
+            return NULL;
+        }
+        for (size_t k = 0; k < tm->capacity; k++)
         {
-            map->cols = len;
-            if (map->cols < 1 || map->cols > MAX_MAP_DIM)
+            if (tm->slots[k].used)
             {
-                fclose(fp);
-                return ERR_INVALID_MAP;
+                size_t i = tile_hash(tm->slots[k].tr, tm->slots[k].tc) & (capacity - 1);
+                while (slots[i].used)
+                {
+                    i = (i + 1) & (capacity - 1);
+                }
+                slots[i] = tm->slots[k];
             }
         }
-        else
+        free(tm->slots);
+        tm->slots = slots;
+        tm->capacity = capacity;
+    }
+    size_t i = tile_hash(tr, tc) & (tm->capacity - 1);
+    while (tm->slots[i].used)
+    {
+        i = (i + 1) & (tm->capacity - 1);
+    }
+    tm->slots[i] = (TileSlot){true, tr, tc, '#', NULL};
+    tm->count++;
+    return &tm->slots[i];
+}
+
+// 首次写入时把隐式的统一分块展开为完整数据
+static bool tile_materialize(TileMap *tm, TileSlot *slot)
+{
+    if (slot->data != NULL)
+    {
+        return true;
+    }
+    slot->data = malloc(sizeof(TileData));
+    if (slot->data == NULL)
+    {
+        return false;
+    }
+    memset(slot->data->cells, slot->fill, sizeof(slot->data->cells));
+    memset(slot->data->terrain, TERRAIN_PLAIN, sizeof(slot->data->terrain));
+    tm->materialized++;
+    return true;
+}
+
+// 分块在地图范围内的行数与列数
+static void tile_extent(const MapBackend *b, const TileSlot *slot, int *rows, int *cols)
+{
+    long r = b->rows - (slot->tr << TILE_SHIFT);
+    long c = b->cols - (slot->tc << TILE_SHIFT);
+    *rows = r < TILE_SIZE ? (int)r : TILE_SIZE;
+    *cols = c < TILE_SIZE ? (int)c : TILE_SIZE;
+}
+
+// 范围内全部为平地 '.' 或全部为 '#' 的分块退回隐式表示
+static void tile_compact(TileMap *tm, TileSlot *slot)
+{
+    if (slot->data == NULL)
+    {
+        return;
+    }
+    int rows, cols;
+    tile_extent(&tm->base, slot, &rows, &cols);
+    char first = slot->data->cells[0][0];
+    if (first != '.' && first != '#')
+    {
+        return;
+    }
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < cols; j++)
         {
-            if (len != map->cols)
+            if (slot->data->cells[i][j] != first || slot->data->terrain[i][j] != TERRAIN_PLAIN)
             {
-                fclose(fp);
-                return ERR_INVALID_MAP;
+                return;
             }
         }
-        for (int i = 0; i < len; i++)
+    }
+    free(slot->data);
+    slot->data = NULL;
+    slot->fill = first;
+    tm->materialized--;
+}
+
+// 压缩一整条分块带（分块行 tr）中的所有分块
+static void tile_compact_band(TileMap *tm, long tr)
+{
+    for (long tc = 0; tc << TILE_SHIFT < tm->base.cols; tc++)
+    {
+        TileSlot *slot = tile_lookup(tm, tr, tc);
+        if (slot != NULL)
+        {
+            tile_compact(tm, slot);
+        }
+    }
+}
+
+static MapBackend *tiles_create(void);
+
+// 只为含有非墙格的分块分配存储；一条分块带读完后立即压缩
+static ErrorCode tiles_append_row(MapBackend *b, const char *row)
+{
+    TileMap *tm = (TileMap *)b;
+    long x = b->rows; // 0 起始
+    long tr = x >> TILE_SHIFT;
+    for (long tc = 0; tc << TILE_SHIFT < b->cols; tc++)
+    {
+        long begin = tc << TILE_SHIFT;
+        long end = begin + TILE_SIZE < b->cols ? begin + TILE_SIZE : b->cols;
+        TileSlot *slot = tile_lookup(tm, tr, tc);
+        if (slot == NULL)
         {
-            char c = buffer[i];
-            if (c != '#' && c != '.' && !(c >= '0' && c <= '9'))
+            long j = begin;
+            while (j < end && row[j] == '#')
             {
-                fclose(fp);
-                return ERR_INVALID_MAP;
+                j++;
             }
-            // 采用 1 索引存储，便于边界检查
-            map->cells[map->rows + 1][i + 1] = c;
+            if (j == end)
+            {
+                continue; // 全墙的片段不需要分块
+            }
+            slot = tile_insert(tm, tr, tc);
         }
-        map->rows++;
-        if (map->rows > MAX_MAP_DIM)
+        if (slot == NULL || !tile_materialize(tm, slot))
         {
-            fclose(fp);
-            return ERR_INVALID_MAP;
+            return ERR_MEMORY;
+        }
+        for (long j = begin; j < end; j++)
+        {
+            unsigned char terrain = MAP_CHAR_TERRAIN[(unsigned char)row[j]];
+            slot->data->cells[x & TILE_MASK][j - begin] = terrain ? '.' : row[j];
+            slot->data->terrain[x & TILE_MASK][j - begin] = terrain;
         }
     }
-    fclose(fp);
+    if ((x & TILE_MASK) == TILE_MASK)
+    {
+        b->rows = x + 1; // 压缩时按已读入的行数确定范围
+        tile_compact_band(tm, tr);
+        b->rows = x;
+    }
     return ERR_NONE;
 }
 
-// 在 validate_map 中进行空区域检查
-ErrorCode validate_map(const Map *map)
+static void tiles_finish_load(MapBackend *b)
 {
-    int visited[MAX_ROWS][MAX_COLS] = {0};
-    int empty_area_count = 0;
-    for (int i = 1; i <= map->rows; i++)
+    if (b->rows > 0 && (b->rows & TILE_MASK) != 0)
     {
-        for (int j = 1; j <= map->cols; j++)
+        tile_compact_band((TileMap *)b, (b->rows - 1) >> TILE_SHIFT);
+    }
+}
+
+static char tiles_cell(const MapBackend *b, long x, long y)
+{
+    const TileSlot *slot = tile_lookup((const TileMap *)b, (x - 1) >> TILE_SHIFT, (y - 1) >> TILE_SHIFT);
+    if (slot == NULL)
+    {
+        return '#';
+    }
+    return slot->data != NULL ? slot->data->cells[(x - 1) & TILE_MASK][(y - 1) & TILE_MASK] : slot->fill;
+}
+
+static int tiles_terrain(const MapBackend *b, long x, long y)
+{
+    const TileSlot *slot = tile_lookup((const TileMap *)b, (x - 1) >> TILE_SHIFT, (y - 1) >> TILE_SHIFT);
+    if (slot == NULL || slot->data == NULL)
+    {
+        return TERRAIN_PLAIN;
+    }
+    return slot->data->terrain[(x - 1) & TILE_MASK][(y - 1) & TILE_MASK];
+}
+
+// 写入后若分块又变成统一内容（例如玩家离开了一块全平地的分块）则立即压缩
+static ErrorCode tiles_set_cell(MapBackend *b, long x, long y, char c)
+{
+    TileMap *tm = (TileMap *)b;
+    long tr = (x - 1) >> TILE_SHIFT, tc = (y - 1) >> TILE_SHIFT;
+    TileSlot *slot = tile_lookup(tm, tr, tc);
+    if ((slot == NULL && c == '#') || (slot != NULL && slot->data == NULL && slot->fill == c))
+    {
+        return ERR_NONE; // 与统一分块的内容相同，无需展开
+    }
+    if (slot == NULL)
+    {
+        slot = tile_insert(tm, tr, tc);
+    }
+    if (slot == NULL || !tile_materialize(tm, slot))
+    {
+        return ERR_MEMORY;
+    }
+    slot->data->cells[(x - 1) & TILE_MASK][(y - 1) & TILE_MASK] = c;
+    if (c == '.' || c == '#')
+    {
+        tile_compact(tm, slot); // 遇到第一个不同的格子即返回
+    }
+    return ERR_NONE;
+}
+
+// 各分块内行优先的第一个匹配取全局最小的 (行, 列)，即整张地图行优先的第一个
+static bool tiles_find(const MapBackend *b, char c, long *x, long *y)
+{
+    const TileMap *tm = (const TileMap *)b;
+    bool found = false;
+    for (size_t k = 0; k < tm->capacity; k++)
+    {
+        const TileSlot *slot = &tm->slots[k];
+        if (!slot->used || (slot->data == NULL && slot->fill != c))
         {
-            if (is_empty(i, j, map) && !visited[i][j])
+            continue;
+        }
+        long base_x = (slot->tr << TILE_SHIFT) + 1, base_y = (slot->tc << TILE_SHIFT) + 1;
+        if (found && (base_x > *x || (base_x == *x && base_y > *y)))
+        {
+            continue; // 整块都在已找到的位置之后
+        }
+        int rows, cols;
+        tile_extent(b, slot, &rows, &cols);
+        for (int i = 0; i < rows; i++)
+        {
+            int j = 0;
+            if (slot->data != NULL)
             {
-                deep_search(i, j, visited, map);
-                empty_area_count++;
-                if (empty_area_count > 1)
+                while (j < cols && slot->data->cells[i][j] != c)
                 {
-                    return ERR_MULTIPLE_EMPTY_AREAS;
+                    j++;
                 }
             }
+            if (j < cols)
+            {
+                long fx = base_x + i, fy = base_y + j;
+                if (!found || fx < *x || (fx == *x && fy < *y))
+                {
+                    *x = fx;
+                    *y = fy;
+                    found = true;
+                }
+                break;
+            }
         }
     }
-    return ERR_NONE;
+    return found;
 }
 
-void deep_search(int x, int y, int visited[MAX_ROWS][MAX_COLS], const Map *map)
+// 分块内的空格子标签：0 为非空，统一空块所有格子为 1
+static uint16_t tile_label_at(const TileSlot *slot, uint16_t *const *labels, size_t k, int i, int j)
 {
-    int dx[] = {-1, 1, 0, 0};
-    int dy[] = {0, 0, -1, 1};
-    visited[x][y] = 1;
-    for (int i = 0; i < 4; i++)
+    if (slot->data == NULL)
+    {
+        return slot->fill == '.' ? 1 : 0;
+    }
+    return labels[k][i * TILE_SIZE + j];
+}
+
+// 分块级连通标记：先在每个分块内部做 BFS 标记，再沿分块边界合并相邻标签；全墙区域完全跳过
+static ErrorCode tiles_validate(const MapBackend *b)
+{
+    const TileMap *tm = (const TileMap *)b;
+    uint16_t **labels = calloc(tm->capacity > 0 ? tm->capacity : 1, sizeof(uint16_t *));
+    int *base = calloc(tm->capacity > 0 ? tm->capacity : 1, sizeof(int));
+    int *queue = malloc(sizeof(int) * TILE_SIZE * TILE_SIZE);
+    int total = 0;
+    ErrorCode err = labels && base && queue ? ERR_NONE : ERR_MEMORY;
+
+    for (size_t k = 0; k < tm->capacity && err == ERR_NONE; k++)
+    {
+        const TileSlot *slot = &tm->slots[k];
+        if (!slot->used)
+        {
+            continue;
+        }
+        base[k] = total;
+        if (slot->data == NULL)
+        {
+            total += slot->fill == '.';
+            continue;
+        }
+        labels[k] = calloc(TILE_SIZE * TILE_SIZE, sizeof(uint16_t));
+        if (labels[k] == NULL)
+        {
+            err = ERR_MEMORY;
+            break;
+        }
+        int rows, cols;
+        tile_extent(b, slot, &rows, &cols);
+        uint16_t next = 0;
+        for (int i = 0; i < rows; i++)
+        {
+            for (int j = 0; j < cols; j++)
+            {
+                if (!cell_is_open(slot->data->cells[i][j]) || labels[k][i * TILE_SIZE + j] != 0)
+                {
+                    continue;
+                }
+                int head = 0, tail = 0;
+                labels[k][i * TILE_SIZE + j] = ++next;
+                queue[tail++] = i * TILE_SIZE + j;
+                while (head < tail)
+                {
+                    int cur = queue[head++];
+                    int ci = cur >> TILE_SHIFT, cj = cur & TILE_MASK;
+                    for (int d = 0; d < 4; d++)
+                    {
+                        int ni = ci + DIR_DX[d], nj = cj + DIR_DY[d];
+                        if (ni >= 0 && ni < rows && nj >= 0 && nj < cols &&
+                            labels[k][ni * TILE_SIZE + nj] == 0 && cell_is_open(slot->data->cells[ni][nj]))
+                        {
+                            labels[k][ni * TILE_SIZE + nj] = next;
+                            queue[tail++] = ni * TILE_SIZE + nj;
+                        }
+                    }
+                }
+            }
+        }
+        total += next;
+    }
+
+    int *parent = err == ERR_NONE ? malloc(sizeof(int) * (total > 0 ? total : 1)) : NULL;
+    if (err == ERR_NONE && parent == NULL)
+    {
+        err = ERR_MEMORY;
+    }
+    int areas = total;
+    for (int l = 0; l < total && err == ERR_NONE; l++)
     {
-        int nx = x + dx[i], ny = y + dy[i];
-        if (nx < 1 || nx > map->rows || ny < 1 || ny > map->cols)
+        parent[l] = l;
+    }
+    // 与右侧、下方的相邻分块沿边界合并
+    for (size_t k = 0; k < tm->capacity && err == ERR_NONE; k++)
+    {
+        const TileSlot *slot = &tm->slots[k];
+        if (!slot->used)
         {
             continue;
         }
-        if (!visited[nx][ny] && is_empty(nx, ny, map))
+        int rows, cols;
+        tile_extent(b, slot, &rows, &cols);
+        for (int side = 0; side < 2; side++)
         {
-            deep_search(nx, ny, visited, map);
+            const TileSlot *next = side == 0 ? tile_lookup(tm, slot->tr, slot->tc + 1)
+                                             : tile_lookup(tm, slot->tr + 1, slot->tc);
+            if (next == NULL)
+            {
+                continue;
+            }
+            size_t nk = (size_t)(next - tm->slots);
+            int span = side == 0 ? rows : cols;
+            for (int t = 0; t < span; t++)
+            {
+                uint16_t a = side == 0 ? tile_label_at(slot, labels, k, t, TILE_SIZE - 1)
+                                       : tile_label_at(slot, labels, k, TILE_SIZE - 1, t);
+                uint16_t c = side == 0 ? tile_label_at(next, labels, nk, t, 0)
+                                       : tile_label_at(next, labels, nk, 0, t);
+                if (a != 0 && c != 0 && uf_union(parent, base[k] + a - 1, base[nk] + c - 1))
+                {
+                    areas--;
+                }
+            }
         }
     }
+    if (err == ERR_NONE && areas > 1)
+    {
+        err = ERR_MULTIPLE_EMPTY_AREAS;
+    }
+    for (size_t k = 0; labels != NULL && k < tm->capacity; k++)
+    {
+        free(labels[k]);
+    }
+    free(labels), free(base), free(queue), free(parent);
+    return err;
 }
 
-bool is_empty(int x, int y, const Map *map)
+static void tiles_destroy(MapBackend *b)
 {
-    // 注意：这里认为空地为 '.' 或者玩家（'1'-'9'）所在位置，
-    // 主要用于连通区域搜索；而在移动时，仅允许移动到 '.' 的位置
-    return (map->cells[x][y] == '.' || is_player(x, y, map, -1));
+    TileMap *tm = (TileMap *)b;
+    for (size_t k = 0; k < tm->capacity; k++)
+    {
+        free(tm->slots[k].data);
+    }
+    free(tm->slots);
+    free(tm);
 }
 
-bool is_player(int x, int y, const Map *map, int player)
+static const MapBackendOps TILES_BACKEND = {"tiles", tiles_create, tiles_append_row, tiles_finish_load, tiles_cell,
+                                            tiles_terrain, tiles_set_cell, tiles_find, NULL, tiles_validate,
+                                            tiles_destroy};
+
+static MapBackend *tiles_create(void)
 {
-    if (player == -1)
+    TileMap *tm = calloc(1, sizeof(TileMap));
+    if (tm == NULL)
     {
-        return map->cells[x][y] >= '1' && map->cells[x][y] <= '9';
+        return NULL;
     }
-    return map->cells[x][y] == (player + '0');
+    tm->base.ops = &TILES_BACKEND;
+    return &tm->base;
 }
 
-void print_map(const Map *map)
+// packed：每格 4 位 ---------------------------------------------------------------
+
+// 4 位编码：0 '#'，1~3 '.' 及其地形（平地、泥地、水），4~13 玩家 '0'~'9'。
+// 偶数列（0 起始）在低 4 位。表长 16 便于 SIMD 查表解码
+#define PACKED_WALL 0
+#define PACKED_EMPTY 1
+#define PACKED_PLAYER 4
+static const char PACKED_CHARS[16] = {'#', '.', ',', '~', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '#', '#'};
+
+// 站在非平地上的玩家格：4 位放不下玩家与地形，地形另记，离开时恢复
+typedef struct
 {
-    for (int i = 1; i <= map->rows; i++)
+    long x, y;
+    unsigned char terrain;
+} PackedUnder;
+
+typedef struct
+{
+    MapBackend base;
+    unsigned char *data; // rows 行，每行 stride 字节
+    long stride;
+    long row_cap;
+    PackedUnder *under;
+    size_t under_count;
+    size_t under_cap;
+} PackedMap;
+
+static inline unsigned packed_get(const PackedMap *pm, long x, long y)
+{
+    unsigned char byte = pm->data[(x - 1) * pm->stride + ((y - 1) >> 1)];
+    return (byte >> (((y - 1) & 1) << 2)) & 0x0F;
+}
+
+static inline void packed_put(PackedMap *pm, long x, long y, unsigned code)
+{
+    unsigned char *byte = &pm->data[(x - 1) * pm->stride + ((y - 1) >> 1)];
+    int shift = ((y - 1) & 1) << 2;
+    *byte = (unsigned char)((*byte & ~(0x0F << shift)) | (code << shift));
+}
+
+static unsigned packed_code(char c)
+{
+    if (c == '#')
     {
-        for (int j = 1; j <= map->cols; j++)
-        {
-            printf("%c", map->cells[i][j]);
-        }
-        printf("\n");
+        return PACKED_WALL;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        return PACKED_PLAYER + (unsigned)(c - '0');
     }
+    return PACKED_EMPTY + MAP_CHAR_TERRAIN[(unsigned char)c];
 }
 
-void trim_newline(char *str)
+// 解码一行：AVX2 下每次把 16 字节查表展开为 32 个字符
+static void packed_unpack_row(const unsigned char *src, long cols, char *out)
 {
-    size_t len = strlen(str);
-    while (len > 0 && (str[len - 1] == '\n' || str[len - 1] == '\r'))
+    long y = 0;
+#if defined(__AVX2__)
+    const __m128i lut = _mm_loadu_si128((const __m128i *)PACKED_CHARS);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    for (; y + 32 <= cols; y += 32)
     {
-        str[len - 1] = '\0';
-        len--;
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + y / 2));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, nibble));
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        _mm_storeu_si128((__m128i *)(out + y), _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((__m128i *)(out + y + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+#endif
+    for (; y < cols; y++)
+    {
+        out[y] = PACKED_CHARS[(src[y >> 1] >> ((y & 1) << 2)) & 0x0F];
     }
 }
 
-// 根据 direction 移动指定玩家
-ErrorCode move_player(Map *map, int player, const char *direction)
+static MapBackend *packed_create(void);
+
+static ErrorCode packed_append_row(MapBackend *b, const char *row)
 {
-    int dx = 0, dy = 0;
-    if (strcmp(direction, "up") == 0)
+    PackedMap *pm = (PackedMap *)b;
+    if (b->rows == 0)
     {
-        dx = -1;
+        pm->stride = (b->cols + 1) / 2;
     }
-    else if (strcmp(direction, "down") == 0)
+    if (b->rows == pm->row_cap)
     {
-        dx = 1;
+        long cap = pm->row_cap > 0 ? pm->row_cap * 2 : 64;
+        unsigned char *data = realloc(pm->data, (size_t)cap * (size_t)pm->stride);
+        if (data == NULL)
+        {
+            return ERR_MEMORY;
+        }
+        pm->data = data;
+        pm->row_cap = cap;
     }
-    else if (strcmp(direction, "left") == 0)
+    unsigned char *dst = pm->data + b->rows * pm->stride;
+    long j = 0;
+    for (; j + 1 < b->cols; j += 2)
     {
-        dy = -1;
+        dst[j >> 1] = (unsigned char)(packed_code(row[j]) | packed_code(row[j + 1]) << 4);
     }
-    else if (strcmp(direction, "right") == 0)
+    if (j < b->cols)
     {
-        dy = 1;
+        dst[j >> 1] = (unsigned char)packed_code(row[j]);
     }
-    else
+    return ERR_NONE;
+}
+
+static PackedUnder *packed_find_under(const PackedMap *pm, long x, long y)
+{
+    for (size_t k = 0; k < pm->under_count; k++)
     {
-        return ERR_MOVE_FAILED; // 无效的移动方向
+        if (pm->under[k].x == x && pm->under[k].y == y)
+        {
+            return &pm->under[k];
+        }
     }
+    return NULL;
+}
 
-    char playerChar = player + '0';
-    int current_x = -1, current_y = -1;
-    // 搜索地图中是否存在该玩家
-    for (int i = 1; i <= map->rows; i++)
+static char packed_cell(const MapBackend *b, long x, long y)
+{
+    unsigned code = packed_get((const PackedMap *)b, x, y);
+    return code < PACKED_PLAYER && code != PACKED_WALL ? '.' : PACKED_CHARS[code];
+}
+
+static int packed_terrain(const MapBackend *b, long x, long y)
+{
+    const PackedMap *pm = (const PackedMap *)b;
+    unsigned code = packed_get(pm, x, y);
+    if (code != PACKED_WALL && code < PACKED_PLAYER)
     {
-        for (int j = 1; j <= map->cols; j++)
+        return (int)(code - PACKED_EMPTY);
+    }
+    const PackedUnder *under = pm->under_count > 0 ? packed_find_under(pm, x, y) : NULL;
+    return under != NULL ? under->terrain : TERRAIN_PLAIN;
+}
+
+static ErrorCode packed_set_cell(MapBackend *b, long x, long y, char c)
+{
+    PackedMap *pm = (PackedMap *)b;
+    unsigned old = packed_get(pm, x, y);
+    int terrain = packed_terrain(b, x, y);
+    PackedUnder *under = pm->under_count > 0 ? packed_find_under(pm, x, y) : NULL;
+    if (c == '.')
+    {
+        packed_put(pm, x, y, PACKED_EMPTY + (unsigned)terrain);
+        if (under != NULL)
         {
-            if (map->cells[i][j] == playerChar)
-            {
-                current_x = i;
-                current_y = j;
-                break;
-            }
+            *under = pm->under[--pm->under_count];
         }
-        if (current_x != -1)
+        return ERR_NONE;
+    }
+    if (old > PACKED_EMPTY && old < PACKED_PLAYER && under == NULL)
+    {
+        // 非平地被覆盖：记下地形以便恢复
+        if (pm->under_count == pm->under_cap)
         {
-            break;
+            size_t cap = pm->under_cap > 0 ? pm->under_cap * 2 : 16;
+            PackedUnder *list = realloc(pm->under, cap * sizeof(PackedUnder));
+            if (list == NULL)
+            {
+                return ERR_MEMORY;
+            }
+            pm->under = list;
+            pm->under_cap = cap;
         }
+        pm->under[pm->under_count++] = (PackedUnder){x, y, (unsigned char)terrain};
     }
+    packed_put(pm, x, y, packed_code(c));
+    return ERR_NONE;
+}
 
-    // 如果地图中没有该玩家，则将玩家放置在第一个空地
-    if (current_x == -1)
+static bool packed_find(const MapBackend *b, char c, long *x, long *y)
+{
+    const PackedMap *pm = (const PackedMap *)b;
+    for (long i = 1; i <= b->rows; i++)
     {
-        for (int i = 1; i <= map->rows; i++)
+        for (long j = 1; j <= b->cols; j++)
         {
-            for (int j = 1; j <= map->cols; j++)
+            unsigned code = packed_get(pm, i, j);
+            char cell = code < PACKED_PLAYER && code != PACKED_WALL ? '.' : PACKED_CHARS[code];
+            if (cell == c)
             {
-                if (map->cells[i][j] == '.')
-                {
-                    map->cells[i][j] = playerChar;
-                    return ERR_NONE;
-                }
+                *x = i;
+                *y = j;
+                return true;
             }
         }
-        return ERR_MOVE_FAILED; // 没有空地放置
     }
+    return false;
+}
 
-    int target_x = current_x + dx;
-    int target_y = current_y + dy;
-    // 检查目标位置是否在地图范围内
-    if (target_x < 1 || target_x > map->rows || target_y < 1 || target_y > map->cols)
+static void packed_row_text(const MapBackend *b, long x, char *out)
+{
+    const PackedMap *pm = (const PackedMap *)b;
+    packed_unpack_row(pm->data + (x - 1) * pm->stride, b->cols, out);
+}
+
+static void packed_destroy(MapBackend *b)
+{
+    PackedMap *pm = (PackedMap *)b;
+    free(pm->data);
+    free(pm->under);
+    free(pm);
+}
+
+// 验证使用通用的逐行流式标记，行文本由 packed_row_text 解码
+static const MapBackendOps PACKED_BACKEND = {"packed", packed_create, packed_append_row, NULL, packed_cell,
+                                             packed_terrain, packed_set_cell, packed_find, packed_row_text, NULL,
+                                             packed_destroy};
+
+static MapBackend *packed_create(void)
+{
+    PackedMap *pm = calloc(1, sizeof(PackedMap));
+    if (pm == NULL)
     {
-        return ERR_MOVE_FAILED;
+        return NULL;
     }
-    // 目标位置必须为空白（即 '.'）
-    if (map->cells[target_x][target_y] != '.')
+    pm->base.ops = &PACKED_BACKEND;
+    return &pm->base;
+}
+
+static const MapBackendOps *const MAP_BACKENDS[] = {&GRID_BACKEND, &RUNS_BACKEND, &TILES_BACKEND, &PACKED_BACKEND};
+
+const MapBackendOps *find_backend(const char *name)
+{
+    for (size_t i = 0; i < sizeof(MAP_BACKENDS) / sizeof(MAP_BACKENDS[0]); i++)
     {
-        return ERR_MOVE_FAILED;
+        if (strcmp(MAP_BACKENDS[i]->name, name) == 0)
+        {
+            return MAP_BACKENDS[i];
+        }
     }
-
-    // 执行移动：原位置置为 '.'，目标位置放置玩家
-    map->cells[current_x][current_y] = '.';
-    map->cells[target_x][target_y] = playerChar;
-    return ERR_NONE;
+    return NULL;
 }
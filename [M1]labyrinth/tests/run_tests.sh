@@ -0,0 +1,378 @@
+#!/bin/sh
+# 命令行回归测试：sh tests/run_tests.sh [可执行文件]，默认使用 ./labyrinth
+# 每个用例比较 stdout 与 stderr（stderr 中匹配 $SKIP_ERR 的行不参与比较，例如计时结果）
+LAB=${1:-./labyrinth}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+SKIP_ERR='^$'
+: > "$TMP/stdin"
+
+# check 名称 期望的stdout 期望的stderr -- 命令参数...（stdin 来自 $TMP/stdin）
+check()
+{
+    name=$1 want_out=$2 want_err=$3
+    shift 4
+    "$LAB" "$@" < "$TMP/stdin" > "$TMP/out" 2> "$TMP/err.raw"
+    grep -v "$SKIP_ERR" "$TMP/err.raw" > "$TMP/err"
+    if [ "$(cat "$TMP/out")" != "$want_out" ] || [ "$(cat "$TMP/err")" != "$want_err" ]; then
+        echo "FAIL $name"
+        echo "  stdout: $(cat "$TMP/out")"
+        echo "  stderr: $(cat "$TMP/err")"
+        failed=1
+    else
+        echo "ok   $name"
+    fi
+}
+
+# check_usage 名称 -- 命令参数...：参数组合非法，程序应打印用法并以非 0 退出
+check_usage()
+{
+    name=$1
+    shift 2
+    if "$LAB" "$@" < "$TMP/stdin" > /dev/null 2> "$TMP/err" || ! head -n 1 "$TMP/err" | grep -q '^Usage:'; then
+        echo "FAIL $name"
+        echo "  stderr: $(cat "$TMP/err")"
+        failed=1
+    else
+        echo "ok   $name"
+    fi
+}
+
+# --goal：两名玩家在一行里互换位置，低优先级的玩家先让到下一行
+printf '1.2\n...\n' > "$TMP/swap.txt"
+check "planner swaps two players" "$(printf '1: right right wait wait\n2: down left up left\n2.1\n...')" "" \
+    -- -m "$TMP/swap.txt" --goal 1=1,3 --goal 2=1,1
+# 没有 --goal 的玩家以当前位置为目标，需要时让路后再回来
+printf '12.\n#.#\n' > "$TMP/aside.txt"
+check "planner steps a goal-less player aside" "$(printf '1: right right\n2: down up\n.21\n#.#')" "" \
+    -- -m "$TMP/aside.txt" --goal 1=1,3
+check "planner rejects a goal on a wall" "" "Invalid goal." -- -m "$TMP/aside.txt" --goal 1=2,1
+
+# --route：D* Lite 沿最短路移动；--block 在途中封住原路径后，观察者修复并改走上方
+printf '1....\n.###.\n.....\n' > "$TMP/detour.txt"
+check "route follows the shortest path" "$(printf '1: down down right right right right\n.....\n.###.\n....1')" "" \
+    -- -m "$TMP/detour.txt" -p 1 --route 3,5
+check "route replans around a block" "$(printf '1: down up right right right right down down\n.....\n.###.\n.#..1')" "" \
+    -- -m "$TMP/detour.txt" -p 1 --route 3,5 --block 1:3,2
+check "route fails once both sides are blocked" "" "No path." \
+    -- -m "$TMP/detour.txt" -p 1 --route 3,5 --block 2:2,5 --block 2:3,4
+check "route rejects a block on the player" "" "Block hit a player." \
+    -- -m "$TMP/detour.txt" -p 1 --route 3,5 --block 0:1,1
+
+# --dijkstra：泥地 ',' 代价 3、水 '~' 代价 5，绕路更便宜时走更长的路线，地形在打印时还原
+printf '1,~.\n....\n' > "$TMP/terrain.txt"
+check "dijkstra detours around water" "$(printf 'cost 5: down right right right up\n.,~1\n....')" "" \
+    -- -m "$TMP/terrain.txt" -p 1 --dijkstra 1,4
+printf '1,.\n###\n' > "$TMP/mud.txt"
+check "dijkstra crosses mud when it must" "$(printf 'cost 4: right right\n.,1\n###')" "" \
+    -- -m "$TMP/mud.txt" -p 1 --dijkstra 1,3
+check "dijkstra reports an unreachable target" "" "No path." -- -m "$TMP/mud.txt" -p 1 --dijkstra 2,1
+
+# --reach：K 步内可进入的格子（含起点）标为 '+'，其他玩家占据的格子不可进入
+printf '1...\n.#..\n..~.\n' > "$TMP/reach.txt"
+check "reach within two moves" "$(printf 'reachable 5\n1++.\n+#..\n+.~.')" "" -- -m "$TMP/reach.txt" -p 1 --reach 2
+check "reach with zero moves" "$(printf 'reachable 1\n1...\n.#..\n..~.')" "" -- -m "$TMP/reach.txt" -p 1 --reach 0
+check "reach saturates the area" "$(printf 'reachable 11\n1+++\n+#++\n++++')" "" -- -m "$TMP/reach.txt" -p 1 --reach 100
+printf '1.2.\n' > "$TMP/blocked.txt"
+check "reach stops at another player" "$(printf 'reachable 2\n1+2.')" "" -- -m "$TMP/blocked.txt" -p 1 --reach 5
+
+# --would-split：环上的格子不是割点，走廊中间的格子是
+printf '.....\n.#.#.\n.....\n' > "$TMP/ring.txt"
+check "would-split on a ring" "no" "" -- -m "$TMP/ring.txt" --would-split 2,1
+printf '...\n#.#\n...\n' > "$TMP/neck.txt"
+check "would-split on a corridor" "yes" "" -- -m "$TMP/neck.txt" --would-split 2,2
+check "would-split on a dead end" "no" "" -- -m "$TMP/neck.txt" --would-split 1,1
+check "would-split outside the map" "" "Invalid cell." -- -m "$TMP/neck.txt" --would-split 4,1
+
+# --set/--edits：编辑在验证后生效；割点索引作为观察者失效并重建，答案随之变化
+check "would-split after closing the ring" "yes" "" -- -m "$TMP/ring.txt" --would-split 2,1 --set 1,3=#
+check "would-split after reopening the ring" "no" "" \
+    -- -m "$TMP/ring.txt" --would-split 2,1 --set 1,3=# --set 1,3=.
+printf '1.\n..\n' > "$TMP/player.txt"
+check "--set places walls and terrain" "$(printf '1~\n.#')" "" -- -m "$TMP/player.txt" -p 1 --set 2,2=# --set 1,2=~
+printf '2,2=#\n\n1,2=,\n' > "$TMP/edits.txt"
+check "--edits applies a file" "$(printf '1,\n.#')" "" -- -m "$TMP/player.txt" -p 1 --edits "$TMP/edits.txt"
+check "--set that splits the area fails" "" "Map contains more than one empty area." \
+    -- -m "$TMP/player.txt" -p 1 --set 1,2=# --set 2,1=#
+check "--set outside the map fails" "" "Edit failed." -- -m "$TMP/player.txt" -p 1 --set 3,3=#
+# 编辑玩家所在的格子被拒绝，玩家保留在地图上
+check "--set on a player cell fails" "" "Edit failed." -- -m "$TMP/player.txt" -p 1 --set '1,1=#'
+
+# --components：在验证之前列出所有空区域；=labels 额外输出标号图
+printf '..#.\n#.#.\n##..\n.###\n' > "$TMP/areas.txt"
+check "components lists every area" "components 3
+1: size 3, rows 1-2, cols 1-2, cell 1,1
+2: size 4, rows 1-3, cols 3-4, cell 1,4
+3: size 1, rows 4-4, cols 1-1, cell 4,1" "" -- -m "$TMP/areas.txt" --components
+check "components dumps labels" "components 3
+1: size 3, rows 1-2, cols 1-2, cell 1,1
+2: size 4, rows 1-3, cols 3-4, cell 1,4
+3: size 1, rows 4-4, cols 1-1, cell 4,1
+11#2
+#1#2
+##22
+3###" "" -- -m "$TMP/areas.txt" --components=labels
+check_usage "components rejects --set" -- -m "$TMP/areas.txt" --components --set 1,1=#
+check_usage "components rejects --edits" -- -m "$TMP/areas.txt" --components --edits "$TMP/edits.txt"
+
+# --repair：打通最少的墙把所有空区域连起来，'0' 不可拆除
+check "repair joins three areas" "$(printf '....\n..#.\n.#..\n.###')" "Removed 3 walls." -- -m "$TMP/areas.txt" --repair
+check "repair leaves a connected map alone" "$(printf '.....\n.#.#.\n.....')" "Removed 0 walls." -- -m "$TMP/ring.txt" --repair
+printf '.0.\n' > "$TMP/zero.txt"
+check "repair never removes '0'" "" "Map cannot be repaired." -- -m "$TMP/zero.txt" --repair
+check_usage "repair rejects --set" -- -m "$TMP/areas.txt" --repair --set 1,3=.
+
+# --stats：运行结束时把插桩报告写到 stderr，地图照常输出；计时与内存随机器变化，不参与比较
+SKIP_ERR='_us \|^peak_rss_kb '
+check "stats on a cross-shaped area" "$(cat "$TMP/neck.txt")" "moves 0
+cells_visited 7
+max_depth 5
+area_cells 7
+area_perimeter 16
+area_dead_ends 4
+area_junctions 2
+area_bbox 1,1-3,3" -- -m "$TMP/neck.txt" -p 1 --stats
+printf '#1#\n' > "$TMP/single.txt"
+check "stats on a single cell" "#1#" "moves 0
+cells_visited 1
+max_depth 1
+area_cells 1
+area_perimeter 4
+area_dead_ends 0
+area_junctions 0
+area_bbox 1,2-1,2" -- -m "$TMP/single.txt" -p 1 --stats
+check "stats count moves" "$(printf '1..\n#.#\n...')" "moves 1
+cells_visited 7
+max_depth 5
+area_cells 7
+area_perimeter 16
+area_dead_ends 4
+area_junctions 2
+area_bbox 1,1-3,3" -- -m "$TMP/neck.txt" -p 1 --move up --stats
+check "stats report after a failed run" "" "Move failed.
+moves 1
+cells_visited 1
+max_depth 1
+area_cells 1
+area_perimeter 4
+area_dead_ends 0
+area_junctions 0
+area_bbox 1,2-1,2" -- -m "$TMP/single.txt" -p 1 --move up --stats
+SKIP_ERR='^$'
+"$LAB" -m "$TMP/neck.txt" -p 1 --stats=json 2>&1 > /dev/null |
+    sed -E 's/"([a-z_]+_us|peak_rss_kb)":[0-9.-]+/"\1":N/g' > "$TMP/stats.json"
+if [ "$(cat "$TMP/stats.json")" = '{"parse_us":N,"validate_us":N,"move_us":N,"moves":0,"print_us":N,"cells_visited":7,"max_depth":5,"peak_rss_kb":N,"area":{"cells":7,"perimeter":16,"dead_ends":4,"junctions":2,"bbox":[1,1,3,3]}}' ]; then
+    echo "ok   stats as json"
+else
+    echo "FAIL stats as json"
+    echo "  stderr: $(cat "$TMP/stats.json")"
+    failed=1
+fi
+
+# --diameter：空区域内最长的最短路，以及每名玩家的离心率；BFS 次数写到 stderr
+check "diameter of a ring" "diameter 6" "Diameter used 11 BFS runs." -- -m "$TMP/ring.txt" --diameter
+printf '1..\n#.#\n..2\n' > "$TMP/eccentric.txt"
+check "diameter with player eccentricities" "$(printf 'diameter 4\nplayer 1 eccentricity 4\nplayer 2 eccentricity 4')" \
+    "Diameter used 7 BFS runs." -- -m "$TMP/eccentric.txt" --diameter
+check "diameter of a single cell" "$(printf 'diameter 0\nplayer 1 eccentricity 0')" "Diameter used 7 BFS runs." \
+    -- -m "$TMP/single.txt" --diameter
+
+# --generate：Eller 算法逐行生成单一空区域的迷宫，输出完全由种子决定
+"$LAB" --generate 7 9 --seed 3 --density 30 --players 2 > "$TMP/maze.txt"
+check "generated maze has one area" "components 1
+1: size 42, rows 1-7, cols 1-9, cell 1,1" "" -- -m "$TMP/maze.txt" --components
+if [ "$(tr -cd '0-9' < "$TMP/maze.txt")" = 12 ]; then
+    echo "ok   generated maze places the players"
+else
+    echo "FAIL generated maze places the players"
+    failed=1
+fi
+check "generated maze is reproducible" "$(cat "$TMP/maze.txt")" "" \
+    -- --generate 7 9 --seed 3 --density 30 --players 2
+check "generate a 2x2 maze" "$(printf '.#\n##')" "" -- --generate 2 2
+check_usage "generate rejects zero rows" -- --generate 0 3
+
+# --bench：CSV 表头固定，每个 规模 x 图案 x 阶段 一行（3 种图案、3 种规模、5 个阶段）
+"$LAB" --bench=1 > "$TMP/bench.csv"
+if [ "$(head -n 1 "$TMP/bench.csv")" = "pattern,rows,cols,phase,runs,median_us,p90_us,p99_us,min_us,max_us" ] &&
+    [ "$(tail -n +2 "$TMP/bench.csv" | cut -d, -f1-5 | sort -u | grep -c ',1$')" = 45 ]; then
+    echo "ok   bench writes one CSV row per case"
+else
+    echo "FAIL bench writes one CSV row per case"
+    failed=1
+fi
+
+# --script：逐行执行命令，失败的命令报告行号后继续；latency 报告随机器变化，不参与比较
+SKIP_ERR='^latency'
+printf 'move 1 down\nquery 2,1\nquery 1,2\nreach 1 1\nbogus\nmove 1 up\nmove 1 up\nprint\n' > "$TMP/stdin"
+check "script runs commands in order" "$(printf '2,1 1\n1,2 .\nreachable 3\n1....\n.###.\n.....')" \
+"line 5: unknown command
+line 7: move failed" -- -m "$TMP/detour.txt" --script -
+# 超出 0~9 的玩家编号被拒绝，地图保持不变
+printf 'move 42 up\nmove -1 up\nreach 10 2\nstep 12 1,1\nprint\n' > "$TMP/stdin"
+check "script rejects out-of-range players" "$(cat "$TMP/detour.txt")" \
+"line 1: Player must be a single digit between 0 and 9.
+line 2: Player must be a single digit between 0 and 9.
+line 3: Player must be a single digit between 0 and 9.
+line 4: Player must be a single digit between 0 and 9." -- -m "$TMP/detour.txt" --script -
+# step：D* Lite 状态在命令之间保留；途中的 set 封住原路径后，路线从下方改走上方
+printf 'step 1 3,5\nstep 1 3,5\nstep 1 3,5\nstep 1 3,5\nstep 1 3,5\nstep 1 3,5\nstep 1 3,5\n' > "$TMP/stdin"
+check "script step follows the shortest path" "$(printf 'down\ndown\nright\nright\nright\nright\narrived')" "" \
+    -- -m "$TMP/detour.txt" --script -
+printf 'step 1 3,5\nset 3,2=#\nstep 1 3,5\nstep 1 3,5\nstep 1 3,5\nstep 1 3,5\nstep 1 3,5\nstep 1 3,5\nstep 1 3,5\nstep 1 3,5\nprint\n' > "$TMP/stdin"
+check "script step replans after set" "$(printf 'down\nup\nright\nright\nright\nright\ndown\ndown\narrived\n.....\n.###.\n.#..1')" "" \
+    -- -m "$TMP/detour.txt" --script -
+# set 与 --set 相同：玩家所在的格子不能编辑
+printf 'set 1,1=#\nset 1,1=,\nset 2,2=~\nprint\n' > "$TMP/stdin"
+check "script set edits cells but not players" "$(printf '1.\n.~')" \
+"line 1: edit failed
+line 2: edit failed" -- -m "$TMP/player.txt" --script -
+SKIP_ERR='^$'
+: > "$TMP/stdin"
+
+# load_map：按 32 字节分块扫描；CRLF 与空行照常处理，非法字节、行宽不一致和超限的地图被拒绝
+printf '1.\r\n\r\n..\r\n' > "$TMP/crlf.txt"
+check "load strips CRLF and skips blank lines" "$(printf '1.\n..')" "" -- -m "$TMP/crlf.txt" -p 1
+printf '1.' > "$TMP/no-newline.txt"
+check "load accepts a missing final newline" "1." "" -- -m "$TMP/no-newline.txt" -p 1
+printf '1.x\n' > "$TMP/bad-char.txt"
+check "load rejects unknown characters" "" "Error loading map file: 3" -- -m "$TMP/bad-char.txt" -p 1
+printf '1.\000\n' > "$TMP/nul.txt"
+check "load rejects NUL bytes" "" "Error loading map file: 3" -- -m "$TMP/nul.txt" -p 1
+printf '1..\n..\n' > "$TMP/ragged.txt"
+check "load rejects ragged rows" "" "Error loading map file: 3" -- -m "$TMP/ragged.txt" -p 1
+# 第二个 32 字节块里的非法字节同样被发现
+printf '1.......................................\n...................................a....\n' > "$TMP/late-bad.txt"
+check "load rejects a bad byte past the first block" "" "Error loading map file: 3" -- -m "$TMP/late-bad.txt" -p 1
+awk 'BEGIN { for (i = 0; i < 100; i++) { s = i ? "." : "1"; for (j = 1; j < 100; j++) s = s "."; print s } }' > "$TMP/max.txt"
+check "load accepts a 100x100 map" "$(cat "$TMP/max.txt")" "" -- -m "$TMP/max.txt" -p 1
+awk '{ print $0 "." }' "$TMP/max.txt" > "$TMP/too-wide.txt"
+check "load rejects 101 columns" "" "Error loading map file: 3" -- -m "$TMP/too-wide.txt" -p 1
+{ cat "$TMP/max.txt"; head -n 1 "$TMP/max.txt" | tr 1 .; } > "$TMP/too-tall.txt"
+check "load rejects 101 rows" "" "Error loading map file: 3" -- -m "$TMP/too-tall.txt" -p 1
+check "load reports a missing file" "" "Error loading map file: 2" -- -m "$TMP/missing.txt" -p 1
+
+# --stream-validate：只保留两行标签逐字节检查单一空区域，不受 100x100 限制
+check "stream-validate accepts a ring" "valid 3 5" "" -- -m "$TMP/ring.txt" --stream-validate
+printf '.#.\n.#.\n...\n' > "$TMP/u-shape.txt"
+check "stream-validate merges arms that meet later" "valid 3 3" "" -- -m "$TMP/u-shape.txt" --stream-validate
+check "stream-validate rejects several areas" "" "Map contains more than one empty area." \
+    -- -m "$TMP/areas.txt" --stream-validate
+check "stream-validate treats '0' as a wall" "" "Map contains more than one empty area." \
+    -- -m "$TMP/zero.txt" --stream-validate
+check "stream-validate strips CRLF" "valid 2 2" "" -- -m "$TMP/crlf.txt" --stream-validate
+check "stream-validate rejects ragged rows" "" "Error loading map file: 3" -- -m "$TMP/ragged.txt" --stream-validate
+check "stream-validate rejects unknown characters" "" "Error loading map file: 3" -- -m "$TMP/bad-char.txt" --stream-validate
+awk 'BEGIN { s = ""; for (j = 0; j < 300; j++) s = s "."; for (i = 0; i < 500; i++) print s }' > "$TMP/open-500x300.txt"
+check "stream-validate accepts a 500x300 map" "valid 500 300" "" -- -m "$TMP/open-500x300.txt" --stream-validate
+awk 'NR == 251 { gsub(/\./, "#") } { print }' "$TMP/open-500x300.txt" > "$TMP/split-500x300.txt"
+check "stream-validate rejects a 500x300 map split in two" "" "Map contains more than one empty area." \
+    -- -m "$TMP/split-500x300.txt" --stream-validate
+
+# -m -：从 stdin 读取地图，各种读取路径都经过同一个入口
+cp "$TMP/detour.txt" "$TMP/stdin"
+check "map from stdin" "$(printf '.....\n1###.\n.....')" "" -- -m - -p 1 --move down
+cp "$TMP/areas.txt" "$TMP/stdin"
+check "stream-validate from stdin" "" "Map contains more than one empty area." -- -m - --stream-validate
+cp "$TMP/maze.txt" "$TMP/stdin"
+check "components from stdin" "components 1
+1: size 42, rows 1-7, cols 1-9, cell 1,1" "" -- -m - --components
+check_usage "script and map cannot both use stdin" -- -m - --script -
+: > "$TMP/stdin"
+
+# 压缩输入：RLE 文本（"!rle" 首行，pD 表示玩家）与 gzip 按开头字节识别
+printf '!rle\np14.\n.3#.\n5.\n' > "$TMP/detour.rle"
+check "load an RLE map" "$(printf '.....\n1###.\n.....')" "" -- -m "$TMP/detour.rle" -p 1 --move down
+printf '!rle\n3.\n3x\n' > "$TMP/bad.rle"
+check "RLE rejects unknown tags" "" "Error loading map file: 3" -- -m "$TMP/bad.rle" -p 1
+printf '!rle\n1000000000.\n' > "$TMP/huge.rle"
+check "RLE stops expanding once the row is too long" "" "Error loading map file: 3" -- -m "$TMP/huge.rle" -p 1
+if command -v gzip > /dev/null; then
+    gzip -c "$TMP/detour.txt" > "$TMP/detour.gz"
+    check "load a gzip map" "$(printf '.....\n1###.\n.....')" "" -- -m "$TMP/detour.gz" -p 1 --move down
+    cp "$TMP/detour.gz" "$TMP/stdin"
+    check "load a gzip map from stdin" "$(cat "$TMP/detour.txt")" "" -- -m - -p 1
+    : > "$TMP/stdin"
+    { head -n 2 "$TMP/detour.txt" | gzip -c; tail -n 1 "$TMP/detour.txt" | gzip -c; } > "$TMP/members.gz"
+    check "load concatenated gzip members" "$(cat "$TMP/detour.txt")" "" -- -m "$TMP/members.gz" -p 1
+    head -c 20 "$TMP/detour.gz" > "$TMP/truncated.gz"
+    check "gzip rejects a truncated file" "" "Error loading map file: 3" -- -m "$TMP/truncated.gz" -p 1
+    cp "$TMP/detour.gz" "$TMP/bad-crc.gz"
+    printf '\377' | dd of="$TMP/bad-crc.gz" bs=1 seek=$(($(wc -c < "$TMP/detour.gz") - 8)) conv=notrunc 2> /dev/null
+    check "gzip rejects a bad CRC" "" "Error loading map file: 3" -- -m "$TMP/bad-crc.gz" -p 1
+    # 超过 32 KB 窗口的输出也要校验 CRC
+    gzip -c "$TMP/open-500x300.txt" > "$TMP/open-500x300.gz"
+    check "stream-validate a large gzip map" "valid 500 300" "" -- -m "$TMP/open-500x300.gz" --stream-validate
+else
+    echo "skip gzip cases: gzip not found"
+fi
+
+# --backend：替换存储后端，移动与批处理的输出与默认的 grid 相同
+for backend in grid runs tiles packed; do
+    check "$backend backend moves a player" "$(printf '.....\n1###.\n.....')" "" \
+        -- -m "$TMP/detour.txt" -p 1 --move down --backend $backend
+    check "$backend backend keeps terrain under players" "$(printf '.,~.\n1...')" "" \
+        -- -m "$TMP/terrain.txt" -p 1 --move down --backend $backend
+    check "$backend backend rejects several areas" "" "Map contains more than one empty area." \
+        -- -m "$TMP/areas.txt" -p 1 --backend $backend
+    SKIP_ERR='^latency'
+    printf 'move 1 down\nquery 2,1\nmove 1 right\nmove 42 up\nprint\n' > "$TMP/stdin"
+    check "$backend backend runs scripts" "$(printf '2,1 1\n.....\n1###.\n.....')" \
+"line 3: move failed
+line 4: Player must be a single digit between 0 and 9." -- -m "$TMP/detour.txt" --script - --backend $backend
+    SKIP_ERR='^$'
+    : > "$TMP/stdin"
+done
+# 玩家离开泥地与水面后地形照旧显示（packed 把玩家脚下的地形另行记录）
+for backend in grid runs tiles packed; do
+    SKIP_ERR='^latency'
+    printf 'move 1 right\nmove 1 right\nprint\nmove 1 right\nprint\n' > "$TMP/stdin"
+    check "$backend backend restores terrain under players" "$(printf '.,1.\n....\n.,~1\n....')" "" \
+        -- -m "$TMP/terrain.txt" --script - --backend $backend
+    SKIP_ERR='^$'
+    : > "$TMP/stdin"
+done
+# runs、tiles 与 packed 没有 100x100 的限制
+awk 'NR == 1 { sub(/\./, "1") } { print }' "$TMP/open-500x300.txt" > "$TMP/player-500x300.txt"
+for backend in runs tiles packed; do
+    SKIP_ERR='^latency'
+    printf 'reach 1 1\nset 1,2=#\nstep 1 3,5\n' > "$TMP/stdin"
+    check "$backend backend refuses grid-only script commands" "" \
+"line 1: reach needs the grid backend
+line 2: set needs the grid backend
+line 3: step needs the grid backend" -- -m "$TMP/detour.txt" --script - --backend $backend
+    SKIP_ERR='^$'
+    : > "$TMP/stdin"
+    check "$backend backend loads a 500x300 map" "$(awk 'NR == 2 { sub(/\./, "1") } { print }' "$TMP/open-500x300.txt")" "" \
+        -- -m "$TMP/player-500x300.txt" -p 1 --move down --backend $backend
+    check "$backend backend rejects a 500x300 map split in two" "" "Map contains more than one empty area." \
+        -- -m "$TMP/split-500x300.txt" -p 1 --backend $backend
+done
+# tiles：玩家跨过 64 格的分块边界后，离开的分块重新压缩，地图内容不变
+awk 'NR == 64 { sub(/\./, "1") } { print }' "$TMP/open-500x300.txt" > "$TMP/edge-500x300.txt"
+SKIP_ERR='^latency'
+printf 'move 1 down\nmove 1 up\nmove 1 down\nquery 64,1\nquery 65,1\n' > "$TMP/stdin"
+check "tiles backend moves across tile borders" "$(printf '64,1 .\n65,1 1')" "" \
+    -- -m "$TMP/edge-500x300.txt" --script - --backend tiles
+SKIP_ERR='^$'
+: > "$TMP/stdin"
+check "grid backend keeps the 100x100 limit" "" "Error loading map file: 3" \
+    -- -m "$TMP/player-500x300.txt" -p 1 --backend grid
+check_usage "unknown backend" -- -m "$TMP/detour.txt" -p 1 --backend nope
+check_usage "backends reject --set" -- -m "$TMP/detour.txt" -p 1 --backend runs --set 1,2=#
+check_usage "backends reject --route" -- -m "$TMP/detour.txt" -p 1 --backend runs --route 3,5
+
+# 邻居掩码：--set 与脚本 set 改变格子后，四个邻居的掩码随之更新
+check "move sees a wall added by --set" "" "Move failed." -- -m "$TMP/detour.txt" -p 1 --set 1,2=# --move right
+check "move sees a cell opened by --set" "$(printf '.....\n1.##.\n.....')" "" \
+    -- -m "$TMP/detour.txt" -p 1 --set 2,2=. --move down
+SKIP_ERR='^latency'
+printf 'move 1 right\nmove 1 down\nset 2,2=.\nmove 1 down\nset 3,2=#\nmove 1 down\nset 3,2=,\nmove 1 down\nmove 1 right\nprint\n' > "$TMP/stdin"
+check "script moves follow edited cells" "$(printf '.....\n..##.\n.,1..')" \
+"line 2: move failed
+line 6: move failed" -- -m "$TMP/detour.txt" --script -
+SKIP_ERR='^$'
+: > "$TMP/stdin"
+
+exit $failed